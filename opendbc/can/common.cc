@@ -1,6 +1,6 @@
 #include "common.h"
 
-unsigned int honda_checksum(uint32_t address, const std::vector<uint8_t> &d) {
+unsigned int honda_checksum(uint32_t address, const kj::ArrayPtr<const uint8_t> &d) {
   int s = 0;
   bool extended = address > 0x7FF;
   while (address) { s += (address & 0xF); address >>= 4; }
@@ -15,7 +15,7 @@ unsigned int honda_checksum(uint32_t address, const std::vector<uint8_t> &d) {
   return s & 0xF;
 }
 
-unsigned int toyota_checksum(uint32_t address, const std::vector<uint8_t> &d) {
+unsigned int toyota_checksum(uint32_t address, const kj::ArrayPtr<const uint8_t> &d) {
   unsigned int s = d.size();
   while (address) { s += address & 0xFF; address >>= 8; }
   for (int i = 0; i < d.size() - 1; i++) { s += d[i]; }
@@ -23,7 +23,7 @@ unsigned int toyota_checksum(uint32_t address, const std::vector<uint8_t> &d) {
   return s & 0xFF;
 }
 
-unsigned int subaru_checksum(uint32_t address, const std::vector<uint8_t> &d) {
+unsigned int subaru_checksum(uint32_t address, const kj::ArrayPtr<const uint8_t> &d) {
   unsigned int s = 0;
   while (address) { s += address & 0xFF; address >>= 8; }
 
@@ -33,7 +33,7 @@ unsigned int subaru_checksum(uint32_t address, const std::vector<uint8_t> &d) {
   return s & 0xFF;
 }
 
-unsigned int chrysler_checksum(uint32_t address, const std::vector<uint8_t> &d) {
+unsigned int chrysler_checksum(uint32_t address, const kj::ArrayPtr<const uint8_t> &d) {
   /* jeep chrysler canbus checksum from http://illmatics.com/Remote%20Car%20Hacking.pdf */
   uint8_t checksum = 0xFF;
   for (int j = 0; j < (d.size() - 1); j++) {
@@ -89,7 +89,7 @@ void init_crc_lookup_tables() {
   gen_crc_lookup_table(0x2F, crc8_lut_8h2f);    // CRC-8 8H2F/AUTOSAR for Volkswagen
 }
 
-unsigned int volkswagen_crc(uint32_t address, const std::vector<uint8_t> &d) {
+unsigned int volkswagen_crc(uint32_t address, const kj::ArrayPtr<const uint8_t> &d) {
   // Volkswagen uses standard CRC8 8H2F/AUTOSAR, but they compute it with
   // a magic variable padding byte tacked onto the end of the payload.
   // https://www.autosar.org/fileadmin/user_upload/standards/classic/4-3/AUTOSAR_SWS_CRCLibrary.pdf
@@ -170,7 +170,7 @@ unsigned int volkswagen_crc(uint32_t address, const std::vector<uint8_t> &d) {
   return crc ^ 0xFF; // Return after standard final XOR for CRC8 8H2F/AUTOSAR
 }
 
-unsigned int pedal_checksum(const std::vector<uint8_t> &d) {
+unsigned int pedal_checksum(const kj::ArrayPtr<const uint8_t> &d) {
   uint8_t crc = 0xFF;
   uint8_t poly = 0xD5; // standard crc8
 
@@ -187,3 +187,17 @@ unsigned int pedal_checksum(const std::vector<uint8_t> &d) {
   }
   return crc;
 }
+
+int find_address(const std::vector<uint32_t> &addresses, uint32_t address) {
+  if (addresses.empty()) return -1;
+
+  // narrow down to the last address <= the one looked up
+  const uint32_t *base = addresses.data();
+  size_t n = addresses.size();
+  while (n > 1) {
+    size_t half = n / 2;
+    base += (base[half] <= address) ? half : 0;
+    n -= half;
+  }
+  return *base == address ? base - addresses.data() : -1;
+}
@@ -2,7 +2,6 @@
 
 #include <vector>
 #include <map>
-#include <unordered_map>
 
 #include "common_dbc.h"
 #include <capnp/dynamic.h>
@@ -18,15 +17,51 @@
 //#define DEBUG printf
 
 #define MAX_BAD_COUNTER 5
+#define MAX_ALL_VALUES 32
 
-// Car specific functions
-unsigned int honda_checksum(uint32_t address, const std::vector<uint8_t> &d);
-unsigned int toyota_checksum(uint32_t address, const std::vector<uint8_t> &d);
-unsigned int subaru_checksum(uint32_t address, const std::vector<uint8_t> &d);
-unsigned int chrysler_checksum(uint32_t address, const std::vector<uint8_t> &d);
+// Car specific functions. message data is passed as a view, e.g. straight from a capnp::Data::Reader
+unsigned int honda_checksum(uint32_t address, const kj::ArrayPtr<const uint8_t> &d);
+unsigned int toyota_checksum(uint32_t address, const kj::ArrayPtr<const uint8_t> &d);
+unsigned int subaru_checksum(uint32_t address, const kj::ArrayPtr<const uint8_t> &d);
+unsigned int chrysler_checksum(uint32_t address, const kj::ArrayPtr<const uint8_t> &d);
 void init_crc_lookup_tables();
-unsigned int volkswagen_crc(uint32_t address, const std::vector<uint8_t> &d);
-unsigned int pedal_checksum(const std::vector<uint8_t> &d);
+unsigned int volkswagen_crc(uint32_t address, const kj::ArrayPtr<const uint8_t> &d);
+unsigned int pedal_checksum(const kj::ArrayPtr<const uint8_t> &d);
+
+// index of address in sorted addresses or -1, a branchless binary search.
+// address sets are known at construction, so lookups go through a flat sorted array.
+int find_address(const std::vector<uint32_t> &addresses, uint32_t address);
+
+// faults of the parse path, recorded without blocking and persisted by a background writer.
+// timeouts and missing messages go to /data/log/can_timeout.txt and can_missing.txt.
+enum class CanFault : uint8_t { TIMEOUT, MISSING, CHECKSUM, COUNTER };
+void can_diagnostics_start();
+void can_diagnostics_record(CanFault type, uint32_t address);
+
+// values of the parsed signals in contiguous arrays indexed by signal id. the signals of
+// a message have consecutive ids, starting at its MessageState::first_sig.
+struct SignalStore {
+  std::vector<uint32_t> addresses;
+  std::vector<const char*> names;
+
+  std::vector<double> values;
+  // a bit per signal, set when its message was parsed since the signal was last cleared
+  std::vector<uint64_t> updated;
+  // ring of the last MAX_ALL_VALUES values of each signal, all_values_count[id] were
+  // pushed since the last clear
+  std::vector<double> all_values;
+  std::vector<uint32_t> all_values_count;
+
+  void add(uint32_t address, const char *name);
+  void push(size_t id, double value) {
+    values[id] = value;
+    all_values[id * MAX_ALL_VALUES + all_values_count[id]++ % MAX_ALL_VALUES] = value;
+  }
+  void set_updated(size_t id) { updated[id / 64] |= 1ULL << (id % 64); }
+  bool is_updated(size_t id) const { return updated[id / 64] & (1ULL << (id % 64)); }
+  std::vector<double> get_all_values(size_t id) const;
+  void clear(size_t id);
+};
 
 class MessageState {
 public:
@@ -34,8 +69,7 @@ public:
   unsigned int size;
 
   std::vector<Signal> parse_sigs;
-  std::vector<double> vals;
-  std::vector<std::vector<double>> all_vals;
+  size_t first_sig;
 
   uint64_t seen;
   uint64_t check_threshold;
@@ -45,8 +79,9 @@ public:
 
   bool ignore_checksum = false;
   bool ignore_counter = false;
+  bool timed_out = false;
 
-  bool parse(uint64_t sec, const std::vector<uint8_t> &dat);
+  bool parse(uint64_t sec, const kj::ArrayPtr<const uint8_t> &dat, SignalStore &store);
   bool update_counter_generic(int64_t v, int cnt_size);
 };
 
@@ -56,7 +91,11 @@ private:
   kj::Array<capnp::word> aligned_buf;
 
   const DBC *dbc = NULL;
-  std::unordered_map<uint32_t, MessageState> message_states;
+  // sorted by address, message_states[i] is the state of message_addresses[i]
+  std::vector<uint32_t> message_addresses;
+  std::vector<MessageState> message_states;
+
+  void set_message_states(std::map<uint32_t, MessageState> &&states);
 
 public:
   bool can_valid = false;
@@ -64,6 +103,7 @@ public:
   uint64_t last_sec = 0;
   uint64_t last_nonempty_sec = 0;
   uint64_t bus_timeout_threshold = 0;
+  SignalStore store;
 
   CANParser(int abus, const std::string& dbc_name,
             const std::vector<MessageParseOptions> &options,
@@ -76,13 +116,18 @@ public:
   void UpdateCans(uint64_t sec, const capnp::DynamicStruct::Reader& cans);
   void UpdateValid(uint64_t sec);
   std::vector<SignalValue> query_latest();
+  void clear_updated();
 };
 
 class CANPacker {
 private:
   const DBC *dbc = NULL;
-  std::map<std::pair<uint32_t, std::string>, Signal> signal_lookup;
-  std::map<uint32_t, Msg> message_lookup;
+  // sorted by address, the signals of each message sorted by name
+  std::vector<uint32_t> message_addresses;
+  std::vector<Msg> messages;
+  std::vector<std::vector<Signal>> message_signals;
+
+  const Signal *lookup_signal(int msg_idx, const char *name);
 
 public:
   CANPacker(const std::string& dbc_name);
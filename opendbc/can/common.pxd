@@ -71,13 +71,24 @@ cdef extern from "common_dbc.h":
 
 cdef extern from "common.h":
   cdef const DBC* dbc_lookup(const string);
+  cdef int MAX_ALL_VALUES
+
+  cdef cppclass SignalStore:
+    vector[uint32_t] addresses
+    vector[const char*] names
+    vector[double] values
+    vector[uint64_t] updated
+    vector[double] all_values
+    vector[uint32_t] all_values_count
 
   cdef cppclass CANParser:
     bool can_valid
     bool bus_timeout
+    SignalStore store
     CANParser(int, string, vector[MessageParseOptions], vector[SignalParseOptions])
     void update_string(string, bool)
     vector[SignalValue] query_latest()
+    void clear_updated()
 
   cdef cppclass CANPacker:
    CANPacker(string)
@@ -42,6 +42,10 @@ enum SignalType {
   CHRYSLER_CHECKSUM,
 };
 
+// generated for each signal by process_dbc.py, returns the sign extended raw value.
+// reads the first extract_len bytes of the message.
+typedef int64_t (*SignalExtractor)(const uint8_t *dat);
+
 struct Signal {
   const char* name;
   int start_bit, msb, lsb, size;
@@ -49,6 +53,8 @@ struct Signal {
   double factor, offset;
   bool is_little_endian;
   SignalType type;
+  SignalExtractor extract;
+  unsigned int extract_len;
 };
 
 struct Msg {
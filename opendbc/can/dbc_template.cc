@@ -3,6 +3,21 @@
 namespace {
 
 {% for address, msg_name, msg_size, sigs in msgs %}
+{% for sig in sigs %}
+{% set reads = signal_reads(sig) %}
+int64_t extract_{{address}}_{{loop.index0}}(const uint8_t *dat) {
+  const uint64_t raw =
+  {% for byte, shift, mask, pos in reads %}
+    ((uint64_t)((dat[{{byte}}] >> {{shift}}) & {{"0x%X" % mask}}) << {{pos}}){{";" if loop.last else " |"}}
+  {% endfor %}
+  {% if sig.is_signed %}
+  return (int64_t)(raw << {{64 - sig.size}}) >> {{64 - sig.size}};
+  {% else %}
+  return raw;
+  {% endif %}
+}
+
+{% endfor %}
 const Signal sigs_{{address}}[] = {
   {% for sig in sigs %}
     {
@@ -40,6 +55,8 @@ const Signal sigs_{{address}}[] = {
       {% else %}
       .type = SignalType::DEFAULT,
       {% endif %}
+      .extract = extract_{{address}}_{{loop.index0}},
+      .extract_len = {{signal_reads(sig) | map(attribute=0) | max + 1}},
     },
   {% endfor %}
 };
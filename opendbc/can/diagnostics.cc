@@ -0,0 +1,151 @@
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <map>
+#include <string>
+#include <mutex>
+#include <thread>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "common.h"
+
+// faults are handed from the parse path to a writer thread through a bounded lock-free
+// queue (Vyukov's MPMC ring). recording never blocks, allocates or touches files,
+// when the ring is full the fault is dropped and counted.
+
+#define DIAGNOSTICS_QUEUE_SIZE 256  // power of 2
+#define DIAGNOSTICS_POLL_MS 50
+#define DIAGNOSTICS_INTERVAL_MS 1000
+
+namespace {
+
+struct Fault {
+  std::atomic<uint64_t> seq;
+  CanFault type;
+  uint32_t address;
+};
+
+Fault queue[DIAGNOSTICS_QUEUE_SIZE];
+std::atomic<uint64_t> queue_head = 0;
+uint64_t queue_tail = 0;  // only used by the writer
+std::atomic<uint64_t> dropped = 0;
+
+bool pop(CanFault &type, uint32_t &address) {
+  Fault &f = queue[queue_tail & (DIAGNOSTICS_QUEUE_SIZE - 1)];
+  if (f.seq.load(std::memory_order_acquire) != queue_tail + 1) return false;
+
+  type = f.type;
+  address = f.address;
+  f.seq.store(queue_tail + DIAGNOSTICS_QUEUE_SIZE, std::memory_order_release);
+  queue_tail++;
+  return true;
+}
+
+// written once, the address of the first message that timed out is read back by controls.
+// every process using a CANParser times out at once when the bus drops, so each writes its own
+// temp file and links it into place, the first link wins and the file is never seen partially written.
+void write_once(const char *path, uint32_t address) {
+  if (access(path, F_OK) == 0) return;
+
+  std::string tmp = std::string(path) + ".XXXXXX";
+  int fd = mkstemp(tmp.data());
+  if (fd < 0) return;
+
+  char buf[16];
+  int len = snprintf(buf, sizeof(buf), "0x%X", address);
+  bool ok = write(fd, buf, len) == len;
+  ok = fchmod(fd, 0644) == 0 && ok;
+  ok = close(fd) == 0 && ok;
+  if (ok) {
+    link(tmp.c_str(), path);  // EEXIST when another writer was first
+  }
+  unlink(tmp.c_str());
+}
+
+void writer_thread() {
+  // timeouts are written within a poll, checks failures are summarized once per interval
+  // instead of printed per message
+  std::map<uint32_t, int> checksum_fails, counter_fails;
+  uint64_t last_dropped = 0;
+  auto last_summary = std::chrono::steady_clock::now();
+
+  while (true) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(DIAGNOSTICS_POLL_MS));
+
+    CanFault type;
+    uint32_t addr;
+    while (pop(type, addr)) {
+      switch (type) {
+        case CanFault::TIMEOUT:
+          write_once("/data/log/can_timeout.txt", addr);
+          break;
+        case CanFault::MISSING:
+          write_once("/data/log/can_missing.txt", addr);
+          break;
+        case CanFault::CHECKSUM:
+          checksum_fails[addr]++;
+          break;
+        case CanFault::COUNTER:
+          counter_fails[addr]++;
+          break;
+      }
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    if (now - last_summary < std::chrono::milliseconds(DIAGNOSTICS_INTERVAL_MS)) continue;
+    last_summary = now;
+
+    for (const auto &[address, count] : checksum_fails) {
+      WARN("0x%X message checks failed, checksum failed %d times\n", address, count);
+    }
+    for (const auto &[address, count] : counter_fails) {
+      WARN("0x%X message checks failed, counter failed %d times\n", address, count);
+    }
+    checksum_fails.clear();
+    counter_fails.clear();
+
+    uint64_t d = dropped.load(std::memory_order_relaxed);
+    if (d != last_dropped) {
+      WARN("can diagnostics dropped %" PRIu64 " faults\n", d - last_dropped);
+      last_dropped = d;
+    }
+  }
+}
+
+}  // namespace
+
+void can_diagnostics_start() {
+  static std::once_flag once;
+  std::call_once(once, []() {
+    for (uint64_t i = 0; i < DIAGNOSTICS_QUEUE_SIZE; i++) {
+      queue[i].seq.store(i, std::memory_order_relaxed);
+    }
+    std::thread(writer_thread).detach();
+  });
+}
+
+void can_diagnostics_record(CanFault type, uint32_t address) {
+  uint64_t pos = queue_head.load(std::memory_order_relaxed);
+  Fault *f;
+  while (true) {
+    f = &queue[pos & (DIAGNOSTICS_QUEUE_SIZE - 1)];
+    int64_t diff = (int64_t)f->seq.load(std::memory_order_acquire) - (int64_t)pos;
+    if (diff == 0) {
+      if (queue_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+    } else if (diff < 0) {
+      // full, the writer is behind
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    } else {
+      pos = queue_head.load(std::memory_order_relaxed);
+    }
+  }
+
+  f->type = type;
+  f->address = address;
+  f->seq.store(pos + 1, std::memory_order_release);
+}
@@ -3,6 +3,7 @@
 #include <algorithm>
 #include <map>
 #include <cmath>
+#include <cstring>
 
 #include "common.h"
 
@@ -31,29 +32,48 @@ CANPacker::CANPacker(const std::string& dbc_name) {
   dbc = dbc_lookup(dbc_name);
   assert(dbc);
 
+  std::map<uint32_t, const Msg*> msgs;
   for (int i = 0; i < dbc->num_msgs; i++) {
-    const Msg* msg = &dbc->msgs[i];
-    message_lookup[msg->address] = *msg;
-    for (int j = 0; j < msg->num_sigs; j++) {
-      const Signal* sig = &msg->sigs[j];
-      signal_lookup[std::make_pair(msg->address, std::string(sig->name))] = *sig;
-    }
+    msgs[dbc->msgs[i].address] = &dbc->msgs[i];
+  }
+  for (const auto& [address, msg] : msgs) {
+    message_addresses.push_back(address);
+    messages.push_back(*msg);
+
+    std::vector<Signal> sigs(msg->sigs, msg->sigs + msg->num_sigs);
+    std::sort(sigs.begin(), sigs.end(), [](const Signal &a, const Signal &b) {
+      return strcmp(a.name, b.name) < 0;
+    });
+    message_signals.push_back(std::move(sigs));
   }
   init_crc_lookup_tables();
 }
 
+const Signal *CANPacker::lookup_signal(int msg_idx, const char *name) {
+  const auto &sigs = message_signals[msg_idx];
+  auto it = std::lower_bound(sigs.begin(), sigs.end(), name, [](const Signal &sig, const char *n) {
+    return strcmp(sig.name, n) < 0;
+  });
+  return it != sigs.end() && strcmp(it->name, name) == 0 ? &(*it) : nullptr;
+}
+
 std::vector<uint8_t> CANPacker::pack(uint32_t address, const std::vector<SignalPackValue> &signals, int counter) {
-  std::vector<uint8_t> ret(message_lookup[address].size, 0);
+  int msg_idx = find_address(message_addresses, address);
+  if (msg_idx < 0) {
+    WARN("undefined message %d\n", address);
+    return {};
+  }
+  std::vector<uint8_t> ret(messages[msg_idx].size, 0);
 
   // set all values for all given signal/value pairs
   for (const auto& sigval : signals) {
-    auto sig_it = signal_lookup.find(std::make_pair(address, sigval.name));
-    if (sig_it == signal_lookup.end()) {
+    const Signal *sig_ptr = lookup_signal(msg_idx, sigval.name.c_str());
+    if (!sig_ptr) {
       // TODO: do something more here. invalid flag like CANParser?
       WARN("undefined signal %s - %d\n", sigval.name.c_str(), address);
       continue;
     }
-    const auto &sig = sig_it->second;
+    const auto &sig = *sig_ptr;
 
     int64_t ival = (int64_t)(round((sigval.value - sig.offset) / sig.factor));
     if (ival < 0) {
@@ -65,12 +85,12 @@ std::vector<uint8_t> CANPacker::pack(uint32_t address, const std::vector<SignalP
 
   // set message counter
   if (counter >= 0){
-    auto sig_it = signal_lookup.find(std::make_pair(address, "COUNTER"));
-    if (sig_it == signal_lookup.end()) {
+    const Signal *sig_ptr = lookup_signal(msg_idx, "COUNTER");
+    if (!sig_ptr) {
       WARN("COUNTER not defined\n");
       return ret;
     }
-    const auto& sig = sig_it->second;
+    const auto& sig = *sig_ptr;
 
     if ((sig.type != SignalType::HONDA_COUNTER) && (sig.type != SignalType::VOLKSWAGEN_COUNTER)) {
       //WARN("COUNTER signal type not valid\n");
@@ -80,26 +100,27 @@ std::vector<uint8_t> CANPacker::pack(uint32_t address, const std::vector<SignalP
   }
 
   // set message checksum
-  auto sig_it_checksum = signal_lookup.find(std::make_pair(address, "CHECKSUM"));
-  if (sig_it_checksum != signal_lookup.end()) {
-    const auto &sig = sig_it_checksum->second;
+  const Signal *sig_checksum = lookup_signal(msg_idx, "CHECKSUM");
+  if (sig_checksum) {
+    const auto &sig = *sig_checksum;
+    const auto dat = kj::arrayPtr<const uint8_t>(ret.data(), ret.size());
     if (sig.type == SignalType::HONDA_CHECKSUM) {
-      unsigned int chksm = honda_checksum(address, ret);
+      unsigned int chksm = honda_checksum(address, dat);
       set_value(ret, sig, chksm);
     } else if (sig.type == SignalType::TOYOTA_CHECKSUM) {
-      unsigned int chksm = toyota_checksum(address, ret);
+      unsigned int chksm = toyota_checksum(address, dat);
       set_value(ret, sig, chksm);
     } else if (sig.type == SignalType::VOLKSWAGEN_CHECKSUM) {
-      unsigned int chksm = volkswagen_crc(address, ret);
+      unsigned int chksm = volkswagen_crc(address, dat);
       set_value(ret, sig, chksm);
     } else if (sig.type == SignalType::SUBARU_CHECKSUM) {
-      unsigned int chksm = subaru_checksum(address, ret);
+      unsigned int chksm = subaru_checksum(address, dat);
       set_value(ret, sig, chksm);
     } else if (sig.type == SignalType::CHRYSLER_CHECKSUM) {
-      unsigned int chksm = chrysler_checksum(address, ret);
+      unsigned int chksm = chrysler_checksum(address, dat);
       set_value(ret, sig, chksm);
     } else if (sig.type == SignalType::PEDAL_CHECKSUM) {
-      unsigned int chksm = pedal_checksum(ret);
+      unsigned int chksm = pedal_checksum(dat);
       set_value(ret, sig, chksm);
     } else {
       //WARN("CHECKSUM signal type not valid\n");
@@ -110,6 +131,8 @@ std::vector<uint8_t> CANPacker::pack(uint32_t address, const std::vector<SignalP
 }
 
 // This function has a definition in common.h and is used in PlotJuggler
+// returns NULL for messages not in the DBC
 Msg* CANPacker::lookup_message(uint32_t address) {
-  return &message_lookup[address];
+  int msg_idx = find_address(message_addresses, address);
+  return msg_idx < 0 ? NULL : &messages[msg_idx];
 }
@@ -11,7 +11,7 @@
 #include "common.h"
 
 
-int64_t get_raw_value(const std::vector<uint8_t> &msg, const Signal &sig) {
+int64_t get_raw_value(const kj::ArrayPtr<const uint8_t> &msg, const Signal &sig) {
   int64_t ret = 0;
 
   int i = sig.msb / 8;
@@ -31,14 +31,49 @@ int64_t get_raw_value(const std::vector<uint8_t> &msg, const Signal &sig) {
 }
 
 
-bool MessageState::parse(uint64_t sec, const std::vector<uint8_t> &dat) {
+void SignalStore::add(uint32_t address, const char *name) {
+  addresses.push_back(address);
+  names.push_back(name);
+  values.push_back(0);
+  updated.resize((names.size() + 63) / 64, 0);
+  all_values.resize(names.size() * MAX_ALL_VALUES, 0);
+  all_values_count.push_back(0);
+}
+
+std::vector<double> SignalStore::get_all_values(size_t id) const {
+  const uint32_t count = all_values_count[id];
+  const double *ring = &all_values[id * MAX_ALL_VALUES];
+  if (count <= MAX_ALL_VALUES) {
+    return std::vector<double>(ring, ring + count);
+  }
+  // overwritten, oldest value first
+  std::vector<double> ret(MAX_ALL_VALUES);
+  for (uint32_t i = 0; i < MAX_ALL_VALUES; i++) {
+    ret[i] = ring[(count + i) % MAX_ALL_VALUES];
+  }
+  return ret;
+}
+
+void SignalStore::clear(size_t id) {
+  updated[id / 64] &= ~(1ULL << (id % 64));
+  all_values_count[id] = 0;
+}
+
+
+bool MessageState::parse(uint64_t sec, const kj::ArrayPtr<const uint8_t> &dat, SignalStore &store) {
 
   for (int i = 0; i < parse_sigs.size(); i++) {
     auto &sig = parse_sigs[i];
 
-    int64_t tmp = get_raw_value(dat, sig);
-    if (sig.is_signed) {
-      tmp -= ((tmp >> (sig.size-1)) & 0x1) ? (1ULL << sig.size) : 0;
+    int64_t tmp;
+    if (sig.extract && dat.size() >= sig.extract_len) {
+      tmp = sig.extract(dat.begin());
+    } else {
+      // short messages keep the partial value of the generic path
+      tmp = get_raw_value(dat, sig);
+      if (sig.is_signed) {
+        tmp -= ((tmp >> (sig.size-1)) & 0x1) ? (1ULL << sig.size) : 0;
+      }
     }
 
     DEBUG("parse 0x%X %s -> %ld\n", address, sig.name, tmp);
@@ -68,13 +103,15 @@ bool MessageState::parse(uint64_t sec, const std::vector<uint8_t> &dat) {
     }
 
     if (checksum_failed || counter_failed) {
-      WARN("0x%X message checks failed, checksum failed %d, counter failed %d\n", address, checksum_failed, counter_failed);
+      can_diagnostics_record(checksum_failed ? CanFault::CHECKSUM : CanFault::COUNTER, address);
       return false;
     }
 
     // TODO: these may get updated if the invalid or checksum gets checked later
-    vals[i] = tmp * sig.factor + sig.offset;
-    all_vals[i].push_back(vals[i]);
+    store.push(first_sig + i, tmp * sig.factor + sig.offset);
+  }
+  for (int i = 0; i < parse_sigs.size(); i++) {
+    store.set_updated(first_sig + i);
   }
   seen = sec;
 
@@ -88,7 +125,7 @@ bool MessageState::update_counter_generic(int64_t v, int cnt_size) {
   if (((old_counter+1) & ((1 << cnt_size) -1)) != v) {
     counter_fail += 1;
     if (counter_fail > 1) {
-      INFO("0x%X COUNTER FAIL #%d -- %d -> %d\n", address, counter_fail, old_counter, (int)v);
+      DEBUG("0x%X COUNTER FAIL #%d -- %d -> %d\n", address, counter_fail, old_counter, (int)v);
     }
     if (counter_fail >= MAX_BAD_COUNTER) {
       return false;
@@ -108,11 +145,13 @@ CANParser::CANParser(int abus, const std::string& dbc_name,
   dbc = dbc_lookup(dbc_name);
   assert(dbc);
   init_crc_lookup_tables();
+  can_diagnostics_start();
 
   bus_timeout_threshold = std::numeric_limits<uint64_t>::max();
 
+  std::map<uint32_t, MessageState> states;
   for (const auto& op : options) {
-    MessageState &state = message_states[op.address];
+    MessageState &state = states[op.address];
     state.address = op.address;
     // state.check_frequency = op.check_frequency,
 
@@ -144,8 +183,6 @@ CANParser::CANParser(int abus, const std::string& dbc_name,
       const Signal *sig = &msg->sigs[i];
       if (sig->type != SignalType::DEFAULT) {
         state.parse_sigs.push_back(*sig);
-        state.vals.push_back(0);
-        state.all_vals.push_back({});
       }
     }
 
@@ -158,13 +195,12 @@ CANParser::CANParser(int abus, const std::string& dbc_name,
         if (strcmp(sig->name, sigop.name) == 0
             && sig->type == SignalType::DEFAULT) {
           state.parse_sigs.push_back(*sig);
-          state.vals.push_back(0);
-          state.all_vals.push_back({});
           break;
         }
       }
     }
   }
+  set_message_states(std::move(states));
 }
 
 CANParser::CANParser(int abus, const std::string& dbc_name, bool ignore_checksum, bool ignore_counter)
@@ -174,7 +210,9 @@ CANParser::CANParser(int abus, const std::string& dbc_name, bool ignore_checksum
   dbc = dbc_lookup(dbc_name);
   assert(dbc);
   init_crc_lookup_tables();
+  can_diagnostics_start();
 
+  std::map<uint32_t, MessageState> states;
   for (int i = 0; i < dbc->num_msgs; i++) {
     const Msg* msg = &dbc->msgs[i];
     MessageState state = {
@@ -187,11 +225,25 @@ CANParser::CANParser(int abus, const std::string& dbc_name, bool ignore_checksum
     for (int j = 0; j < msg->num_sigs; j++) {
       const Signal *sig = &msg->sigs[j];
       state.parse_sigs.push_back(*sig);
-      state.vals.push_back(0);
-      state.all_vals.push_back({});
     }
 
-    message_states[state.address] = state;
+    states[state.address] = state;
+  }
+  set_message_states(std::move(states));
+}
+
+void CANParser::set_message_states(std::map<uint32_t, MessageState> &&states) {
+  // the parser reads a single bus, so the address alone is the key
+  message_addresses.clear();
+  message_states.clear();
+  store = SignalStore();
+  for (auto &[address, state] : states) {
+    state.first_sig = store.names.size();
+    for (const auto &sig : state.parse_sigs) {
+      store.add(address, sig.name);
+    }
+    message_addresses.push_back(address);
+    message_states.push_back(std::move(state));
   }
 }
 
@@ -229,8 +281,8 @@ void CANParser::UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Rea
     }
     bus_empty = false;
 
-    auto state_it = message_states.find(cmsg.getAddress());
-    if (state_it == message_states.end()) {
+    int state_idx = find_address(message_addresses, cmsg.getAddress());
+    if (state_idx < 0) {
       // DEBUG("skip %d: not specified\n", cmsg.getAddress());
       continue;
     }
@@ -243,14 +295,13 @@ void CANParser::UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Rea
     }
 
     // TODO: this actually triggers for some cars. fix and enable this
-    //if (dat.size() != state_it->second.size) {
+    //if (dat.size() != message_states[state_idx].size) {
     //  DEBUG("got message with unexpected length: expected %d, got %zu for %d", state_it->second.size, dat.size(), cmsg.getAddress());
     //  continue;
     //}
 
-    std::vector<uint8_t> data(dat.size(), 0);
-    memcpy(data.data(), dat.begin(), dat.size());
-    state_it->second.parse(sec, data);
+    // parsed in place, no copy of the message
+    message_states[state_idx].parse(sec, dat, store);
   }
 
   // update bus timeout
@@ -270,40 +321,31 @@ void CANParser::UpdateCans(uint64_t sec, const capnp::DynamicStruct::Reader& cms
     return;
   }
 
-  auto state_it = message_states.find(cmsg.get("address").as<uint32_t>());
-  if (state_it == message_states.end()) {
+  int state_idx = find_address(message_addresses, cmsg.get("address").as<uint32_t>());
+  if (state_idx < 0) {
     DEBUG("skip %d: not specified\n", cmsg.get("address").as<uint32_t>());
     return;
   }
 
   auto dat = cmsg.get("dat").as<capnp::Data>();
   if (dat.size() > 64) return; // shouldn't ever happen
-  std::vector<uint8_t> data(dat.size(), 0);
-  memcpy(data.data(), dat.begin(), dat.size());
-  state_it->second.parse(sec, data);
+  message_states[state_idx].parse(sec, dat, store);
 }
 
 void CANParser::UpdateValid(uint64_t sec) {
   can_valid = true;
-  for (const auto& kv : message_states) {
-    const auto& state = kv.second;
+  for (auto& state : message_states) {
     if (state.check_threshold > 0 && (sec - state.seen) > state.check_threshold && sec > 105000000000) {
       // opkr
-      char chk_cmd[100];
-      if (state.seen > 0 ) {
-        DEBUG("0x%X TIMEOUT\n", state.address);
-        if(access("/data/log/can_timeout.txt", F_OK) == -1) {
-          sprintf(chk_cmd, "echo -n 0x%X > /data/log/can_timeout.txt", state.address);
-          system(chk_cmd);
-        }
-      } else {
-        DEBUG("0x%X MISSING\n", state.address);
-        if(access("/data/log/can_missing.txt", F_OK) == -1) {
-          sprintf(chk_cmd, "echo -n 0x%X > /data/log/can_missing.txt", state.address);
-          system(chk_cmd);
-        }
+      if (!state.timed_out) {
+        // recorded once per timeout, the writer keeps the first address in the file
+        DEBUG("0x%X %s\n", state.address, state.seen > 0 ? "TIMEOUT" : "MISSING");
+        can_diagnostics_record(state.seen > 0 ? CanFault::TIMEOUT : CanFault::MISSING, state.address);
+        state.timed_out = true;
       }
       can_valid = false;
+    } else {
+      state.timed_out = false;
     }
   }
 }
@@ -311,21 +353,25 @@ void CANParser::UpdateValid(uint64_t sec) {
 std::vector<SignalValue> CANParser::query_latest() {
   std::vector<SignalValue> ret;
 
-  for (auto& kv : message_states) {
-    auto& state = kv.second;
+  for (auto& state : message_states) {
     if (last_sec != 0 && state.seen != last_sec) continue;
 
     for (int i = 0; i < state.parse_sigs.size(); i++) {
-      const Signal &sig = state.parse_sigs[i];
+      const size_t id = state.first_sig + i;
       ret.push_back((SignalValue){
         .address = state.address,
-        .name = sig.name,
-        .value = state.vals[i],
-        .all_values = state.all_vals[i],
+        .name = state.parse_sigs[i].name,
+        .value = store.values[id],
+        .all_values = store.get_all_values(id),
       });
-      state.all_vals[i].clear();
+      store.clear(id);
     }
   }
 
   return ret;
 }
+
+void CANParser::clear_updated() {
+  std::fill(store.updated.begin(), store.updated.end(), 0);
+  std::fill(store.all_values_count.begin(), store.all_values_count.end(), 0);
+}
@@ -9,12 +9,17 @@ from libcpp cimport bool
 from libcpp.map cimport map
 
 from .common cimport CANParser as cpp_CANParser
-from .common cimport SignalParseOptions, MessageParseOptions, dbc_lookup, SignalValue, DBC
+from .common cimport SignalParseOptions, MessageParseOptions, dbc_lookup, SignalValue, DBC, MAX_ALL_VALUES
 
 import os
 import numbers
 from collections import defaultdict
 
+import numpy as np
+
+cdef extern from *:
+  int ctzll "__builtin_ctzll"(unsigned long long)
+
 cdef int CAN_INVALID_CNT = 5
 
 
@@ -26,6 +31,10 @@ cdef class CANParser:
     map[uint32_t, string] address_to_msg_name
     vector[SignalValue] can_values
 
+    list sig_names
+    list sig_vl
+    list sig_vl_all
+
   cdef readonly:
     dict vl
     dict vl_all
@@ -33,6 +42,12 @@ cdef class CANParser:
     bool bus_timeout
     string dbc_name
     int can_invalid_cnt
+    # numpy views over the signal arrays of the parser, indexed by the ids in signal_ids.
+    # updated is a bitmask of the signals parsed by the last update, a bit per signal id.
+    # the views are only valid while the parser is alive.
+    dict signal_ids
+    object values
+    object updated
 
   def __init__(self, dbc_name, signals, checks=None, bus=0, enforce_checks=True):
     if checks is None:
@@ -102,11 +117,33 @@ cdef class CANParser:
       message_options_v.push_back(mpo)
 
     self.can = new cpp_CANParser(bus, dbc_name, message_options_v, signal_options_v)
-    self.update_vl()
-
-  cdef unordered_set[uint32_t] update_vl(self):
-    cdef unordered_set[uint32_t] updated_addrs
 
+    # the signal arrays are laid out once by the parser and never move
+    cdef size_t num_sigs = self.can.store.names.size()
+    self.signal_ids = {}
+    self.sig_names = []
+    self.sig_vl = []
+    self.sig_vl_all = []
+    for i in range(num_sigs):
+      address = self.can.store.addresses[i]
+      sig_name = self.can.store.names[i].decode('utf8')
+      self.signal_ids[(address, sig_name)] = i
+      self.signal_ids[(self.address_to_msg_name[address].decode('utf8'), sig_name)] = i
+      self.sig_names.append(sig_name)
+      self.sig_vl.append(self.vl[address])
+      self.sig_vl_all.append(self.vl_all[address])
+      # requested signals are readable before their message is first seen
+      self.vl[address][sig_name] = self.can.store.values[i]
+
+    if num_sigs > 0:
+      self.values = np.asarray(<double[:num_sigs]> self.can.store.values.data())
+      self.updated = np.asarray(<uint64_t[:self.can.store.updated.size()]> self.can.store.updated.data())
+    else:
+      self.values = np.zeros(0, dtype=np.float64)
+      self.updated = np.zeros(0, dtype=np.uint64)
+    self.update_valid()
+
+  cdef void update_valid(self):
     # Update invalid flag
     self.can_invalid_cnt += 1
     if self.can.can_valid:
@@ -114,32 +151,63 @@ cdef class CANParser:
     self.can_valid = self.can_invalid_cnt < CAN_INVALID_CNT
     self.bus_timeout = self.can.bus_timeout
 
-    new_vals = self.can.query_latest()
-    for cv in new_vals:
-      # Cast char * directly to unicode
-      cv_name = <unicode>cv.name
-      self.vl[cv.address][cv_name] = cv.value
-      self.vl_all[cv.address][cv_name].extend(cv.all_values)
-      updated_addrs.insert(cv.address)
+  cdef unordered_set[uint32_t] update_vl(self):
+    cdef unordered_set[uint32_t] updated_addrs
+    cdef size_t i, sig_id
+    cdef uint64_t word
+    cdef uint32_t count, k
+    cdef double *ring
+
+    # only the signals with a bit in the mask are touched
+    for i in range(self.can.store.updated.size()):
+      word = self.can.store.updated[i]
+      while word:
+        sig_id = i * 64 + ctzll(word)
+        word &= word - 1
+
+        name = self.sig_names[sig_id]
+        self.sig_vl[sig_id][name] = self.can.store.values[sig_id]
+
+        vl_all = self.sig_vl_all[sig_id][name]
+        count = self.can.store.all_values_count[sig_id]
+        ring = self.can.store.all_values.data() + sig_id * MAX_ALL_VALUES
+        for k in range(count - min(count, MAX_ALL_VALUES), count):
+          vl_all.append(ring[k % MAX_ALL_VALUES])
+        updated_addrs.insert(self.can.store.addresses[sig_id])
 
     return updated_addrs
 
+  def all_values(self, size_t sig_id):
+    """values of a signal parsed by the last update, oldest first. a view while the ring
+    of the signal has not wrapped, only the last MAX_ALL_VALUES are kept."""
+    if sig_id >= self.can.store.all_values_count.size():
+      raise IndexError(f"signal id {sig_id} out of range")
+    cdef uint32_t count = self.can.store.all_values_count[sig_id]
+    cdef double *ring = self.can.store.all_values.data() + sig_id * MAX_ALL_VALUES
+    if count == 0:
+      return np.zeros(0, dtype=np.float64)
+    elif count <= MAX_ALL_VALUES:
+      return np.asarray(<double[:count]> ring)
+    return np.roll(np.asarray(<double[:MAX_ALL_VALUES]> ring), -(count % MAX_ALL_VALUES))
+
   def update_string(self, dat, sendcan=False):
     for v in self.vl_all.values():
       v.clear()
 
+    self.can.clear_updated()
     self.can.update_string(dat, sendcan)
+    self.update_valid()
     return self.update_vl()
 
   def update_strings(self, strings, sendcan=False):
     for v in self.vl_all.values():
       v.clear()
 
-    updated_addrs = set()
+    self.can.clear_updated()
     for s in strings:
       self.can.update_string(s, sendcan)
-      updated_addrs.update(self.update_vl())
-    return updated_addrs
+      self.update_valid()
+    return self.update_vl()
 
 
 cdef class CANDefine():
@@ -7,6 +7,22 @@ import jinja2
 from collections import Counter
 from opendbc.can.dbc import dbc
 
+def signal_reads(sig):
+  """bytes read by the generated extractor of sig, as (byte, shift, mask, position).
+  follows the same bit order as get_raw_value in parser.cc"""
+  reads = []
+  i = sig.msb // 8
+  bits = sig.size
+  while i >= 0 and bits > 0:
+    lsb = sig.lsb if sig.lsb // 8 == i else i * 8
+    msb = sig.msb if sig.msb // 8 == i else (i + 1) * 8 - 1
+    size = msb - lsb + 1
+    reads.append((i, lsb - i * 8, (1 << size) - 1, bits - size))
+    bits -= size
+    i = i - 1 if sig.is_little_endian else i + 1
+  return reads
+
+
 def process(in_fn, out_fn):
   dbc_name = os.path.split(out_fn)[-1].replace('.cc', '')
   # print("processing %s: %s -> %s" % (dbc_name, in_fn, out_fn))
@@ -103,7 +119,8 @@ def process(in_fn, out_fn):
     if count > 1:
       sys.exit("%s: Duplicate message name in DBC file %s" % (dbc_name, name))
 
-  parser_code = template.render(dbc=can_dbc, checksum_type=checksum_type, msgs=msgs, def_vals=def_vals)
+  parser_code = template.render(dbc=can_dbc, checksum_type=checksum_type, msgs=msgs, def_vals=def_vals,
+                                signal_reads=signal_reads)
 
   with open(out_fn, "a+") as out_f:
     out_f.seek(0)
@@ -486,6 +486,18 @@ std::map<std::string, std::string> Params::readAll() {
   return util::read_files_in_dir(getParamPath());
 }
 
+std::map<std::string, std::string> Params::readKeys(const std::vector<std::string> &keys) {
+  FileLock file_lock(params_path + "/.lock");
+  std::map<std::string, std::string> ret;
+  for (const auto &key : keys) {
+    const std::string path = getParamPath(key);
+    if (util::file_exists(path)) {
+      ret[key] = util::read_file(path);
+    }
+  }
+  return ret;
+}
+
 void Params::clearAll(ParamKeyType key_type) {
   FileLock file_lock(params_path + "/.lock");
 
@@ -2,6 +2,7 @@
 
 #include <map>
 #include <string>
+#include <vector>
 
 enum ParamKeyType {
   PERSISTENT = 0x02,
@@ -31,6 +32,8 @@ public:
     return get(key) == "1";
   }
   std::map<std::string, std::string> readAll();
+  // like readAll for a subset of keys, keys without a value are left out
+  std::map<std::string, std::string> readKeys(const std::vector<std::string> &keys);
 
   // helpers for writing values
   int put(const char *key, const char *val, size_t value_size);
@@ -0,0 +1,218 @@
+#include "selfdrive/loggerd/can_codec.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <capnp/serialize.h>
+
+#include "cereal/messaging/messaging.h"
+
+namespace {
+
+const uint32_t CAN_LOG_MAGIC = 0x434e4143;  // "CANC"
+const uint32_t CAN_LOG_VERSION = 1;
+
+enum CanEventFlags : uint8_t {
+  SENDCAN = 0x1,
+  VALID = 0x2,
+};
+
+inline uint64_t dat_key(uint8_t src, uint32_t address) {
+  return ((uint64_t)src << 32) | address;
+}
+
+inline void put_varint(std::string &s, uint64_t v) {
+  while (v >= 0x80) {
+    s.push_back((char)(v | 0x80));
+    v >>= 7;
+  }
+  s.push_back((char)v);
+}
+
+inline void put_svarint(std::string &s, int64_t v) {
+  put_varint(s, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+inline void put_u32(std::string &s, uint32_t v) {
+  s.append((const char *)&v, sizeof(v));
+}
+
+inline void put_column(std::string &s, const std::string &col) {
+  put_varint(s, col.size());
+  s += col;
+}
+
+class Cursor {
+public:
+  Cursor() : p(nullptr), end(nullptr) {}
+  Cursor(const char *b, const char *e) : p(b), end(e) {}
+
+  inline bool varint(uint64_t &v) {
+    v = 0;
+    for (int shift = 0; shift < 64 && p < end; shift += 7) {
+      uint8_t b = *p++;
+      v |= (uint64_t)(b & 0x7f) << shift;
+      if (!(b & 0x80)) return true;
+    }
+    return false;
+  }
+  inline bool svarint(int64_t &v) {
+    uint64_t u;
+    if (!varint(u)) return false;
+    v = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+    return true;
+  }
+  inline bool u8(uint8_t &v) {
+    if (p >= end) return false;
+    v = *p++;
+    return true;
+  }
+  inline bool u32(uint32_t &v) {
+    if (end - p < (ptrdiff_t)sizeof(v)) return false;
+    memcpy(&v, p, sizeof(v));
+    p += sizeof(v);
+    return true;
+  }
+  inline bool bytes(size_t n, const char *&out) {
+    if ((size_t)(end - p) < n) return false;
+    out = p;
+    p += n;
+    return true;
+  }
+  inline bool column(Cursor &col) {
+    uint64_t n;
+    const char *begin;
+    if (!varint(n) || !bytes(n, begin)) return false;
+    col = Cursor(begin, begin + n);
+    return true;
+  }
+  inline bool done() const { return p >= end; }
+
+private:
+  const char *p, *end;
+};
+
+bool decode_block(Cursor &in, std::string &out) {
+  uint32_t magic, version;
+  uint64_t n_events, n_frames;
+  if (!in.u32(magic) || magic != CAN_LOG_MAGIC) return false;
+  if (!in.u32(version) || version != CAN_LOG_VERSION) return false;
+  if (!in.varint(n_events) || !in.varint(n_frames)) return false;
+
+  const char *flags;
+  Cursor mono_time_col, frame_count_col, address_col, src_col, bus_time_col, dat_len_col, dat_col;
+  if (!in.bytes(n_events, flags) ||
+      !in.column(mono_time_col) || !in.column(frame_count_col) ||
+      !in.column(address_col) || !in.column(src_col) || !in.column(bus_time_col) ||
+      !in.column(dat_len_col) || !in.column(dat_col)) {
+    return false;
+  }
+
+  uint64_t mono_time = 0;
+  uint16_t bus_time = 0;
+  std::unordered_map<uint64_t, std::string> prev_dat;
+  uint8_t dat[256];
+  uint64_t frames_decoded = 0;
+
+  for (uint64_t i = 0; i < n_events; ++i) {
+    int64_t mono_time_delta;
+    uint64_t count;
+    if (!mono_time_col.svarint(mono_time_delta) || !frame_count_col.varint(count)) return false;
+    mono_time += mono_time_delta;
+
+    MessageBuilder msg;
+    auto event = msg.initEvent(flags[i] & VALID);
+    event.setLogMonoTime(mono_time);
+    auto frames = (flags[i] & SENDCAN) ? event.initSendcan(count) : event.initCan(count);
+    for (uint64_t j = 0; j < count; ++j) {
+      uint64_t address;
+      uint8_t src, len;
+      int64_t bus_time_delta;
+      const char *xored;
+      if (!address_col.varint(address) || !src_col.u8(src) || !bus_time_col.svarint(bus_time_delta) ||
+          !dat_len_col.u8(len) || !dat_col.bytes(len, xored)) {
+        return false;
+      }
+      bus_time += bus_time_delta;
+
+      std::string &prev = prev_dat[dat_key(src, address)];
+      for (int k = 0; k < len; ++k) {
+        dat[k] = xored[k] ^ (k < prev.size() ? prev[k] : 0);
+      }
+      prev.assign((const char *)dat, len);
+
+      auto frame = frames[j];
+      frame.setAddress(address);
+      frame.setBusTime(bus_time);
+      frame.setDat(capnp::Data::Reader(dat, len));
+      frame.setSrc(src);
+      ++frames_decoded;
+    }
+
+    auto bytes = msg.toBytes();
+    out.append((const char *)bytes.begin(), bytes.size());
+  }
+  return frames_decoded == n_frames && dat_col.done();
+}
+
+}  // namespace
+
+void CanLogEncoder::add(const cereal::Event::Reader &event) {
+  const bool sendcan = event.which() == cereal::Event::SENDCAN;
+  auto frames = sendcan ? event.getSendcan() : event.getCan();
+
+  event_flags.push_back((sendcan ? SENDCAN : 0) | (event.getValid() ? VALID : 0));
+  put_svarint(mono_time_col, (int64_t)(event.getLogMonoTime() - prev_mono_time));
+  put_varint(frame_count_col, frames.size());
+  prev_mono_time = event.getLogMonoTime();
+
+  for (auto frame : frames) {
+    const uint32_t address = frame.getAddress();
+    const uint8_t src = frame.getSrc();
+    auto dat = frame.getDat();
+
+    put_varint(address_col, address);
+    src_col.push_back((char)src);
+    put_svarint(bus_time_col, (int16_t)(frame.getBusTime() - prev_bus_time));
+    prev_bus_time = frame.getBusTime();
+
+    // the xor against the last payload is mostly zeros, which bz2 squeezes well
+    std::string &prev = prev_dat[dat_key(src, address)];
+    const size_t len = std::min<size_t>(dat.size(), 255);
+    dat_len_col.push_back((char)len);
+    for (size_t k = 0; k < len; ++k) {
+      dat_col.push_back((char)(dat[k] ^ (k < prev.size() ? (uint8_t)prev[k] : 0)));
+    }
+    prev.assign((const char *)dat.begin(), len);
+    ++frame_count;
+  }
+}
+
+std::string CanLogEncoder::finish() {
+  std::string out;
+  put_u32(out, CAN_LOG_MAGIC);
+  put_u32(out, CAN_LOG_VERSION);
+  put_varint(out, event_flags.size());
+  put_varint(out, frame_count);
+  out.append((const char *)event_flags.data(), event_flags.size());
+  for (auto col : {&mono_time_col, &frame_count_col, &address_col, &src_col, &bus_time_col, &dat_len_col, &dat_col}) {
+    put_column(out, *col);
+    col->clear();
+  }
+
+  // blocks are self-contained
+  prev_mono_time = 0;
+  prev_bus_time = 0;
+  prev_dat.clear();
+  event_flags.clear();
+  frame_count = 0;
+  return out;
+}
+
+bool can_log_decode(const std::string &data, std::string &out) {
+  Cursor in(data.data(), data.data() + data.size());
+  while (!in.done()) {
+    if (!decode_block(in, out)) return false;
+  }
+  return true;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "cereal/gen/cpp/log.capnp.h"
+
+// Columnar encoding for can/sendcan events.
+//
+// Events are collected into blocks. Each block stores one column per field:
+// event kind/valid flags, logMonoTime deltas, frame counts, addresses, srcs,
+// busTime deltas, payload lengths and payloads XORed against the previous
+// payload seen on the same (src, address). Blocks are self-contained, so a
+// truncated file still decodes up to the last complete block. Decoding
+// rebuilds the original Events, serialized back to back like in an rlog.
+
+const int CAN_LOG_BLOCK_EVENTS = 1000;
+
+class CanLogEncoder {
+public:
+  // event must be a can or sendcan event
+  void add(const cereal::Event::Reader &event);
+  inline bool empty() const { return event_flags.empty(); }
+  inline bool full() const { return event_flags.size() >= CAN_LOG_BLOCK_EVENTS; }
+  // serialize the current block and start a new one
+  std::string finish();
+
+private:
+  uint64_t prev_mono_time = 0;
+  uint16_t prev_bus_time = 0;
+  std::unordered_map<uint64_t, std::string> prev_dat;
+
+  std::vector<uint8_t> event_flags;
+  std::string mono_time_col, frame_count_col;
+  std::string address_col, src_col, bus_time_col, dat_len_col, dat_col;
+  size_t frame_count = 0;
+};
+
+inline bool can_log_is_can_event(cereal::Event::Which which) {
+  return which == cereal::Event::CAN || which == cereal::Event::SENDCAN;
+}
+
+// decode a stream of blocks into serialized Events. returns false on a corrupt block,
+// events decoded up to that point are kept in out.
+bool can_log_decode(const std::string &data, std::string &out);
@@ -3,6 +3,9 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <ftw.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
 #include <cassert>
 #include <cerrno>
@@ -10,9 +13,11 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <climits>
 #include <ctime>
 #include <fstream>
 #include <iostream>
+#include <set>
 #include <streambuf>
 #ifdef QCOM
 #include <cutils/properties.h>
@@ -32,10 +37,7 @@ void append_property(const char* key, const char* value, void *cookie) {
 }
 
 // ***** log metadata *****
-kj::Array<capnp::word> logger_build_init_data() {
-  MessageBuilder msg;
-  auto init = msg.initEvent().initInitData();
-
+static void init_static_data(cereal::InitData::Builder init) {
   if (Hardware::EON()) {
     init.setDeviceType(cereal::InitData::DeviceType::NEO);
   } else if (Hardware::TICI()) {
@@ -76,15 +78,14 @@ kj::Array<capnp::word> logger_build_init_data() {
 #endif
 
   init.setDirty(!getenv("CLEAN"));
+}
 
+static void init_params(cereal::InitData::Builder init, Params &params, std::map<std::string, std::string> &params_map) {
   // log params
-  auto params = Params();
-  std::map<std::string, std::string> params_map = params.readAll();
-
   init.setGitCommit(params_map["GitCommit"]);
   init.setGitBranch(params_map["GitBranch"]);
   init.setGitRemote(params_map["GitRemote"]);
-  init.setPassive(params.getBool("Passive"));
+  init.setPassive(params_map["Passive"] == "1");
   init.setDongleId(params_map["DongleId"]);
 
   auto lparams = init.initParams().initEntries(params_map.size());
@@ -96,8 +97,90 @@ kj::Array<capnp::word> logger_build_init_data() {
       lentry.setValue(capnp::Data::Reader((const kj::byte*)value.data(), value.size()));
     }
     i++;
+  }
+}
+
+InitDataCache::InitDataCache() {
+  init_static_data(static_msg.initRoot<cereal::InitData>());
+
+#ifdef __linux__
+  // the params path is a symlink to the directory holding the values, watch the directory itself.
+  // start watching before the initial read so no change can slip in between
+  char params_dir[PATH_MAX];
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd >= 0 &&
+      (realpath(params.getParamPath().c_str(), params_dir) == nullptr ||
+       inotify_add_watch(inotify_fd, params_dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0)) {
+    LOGE("failed to watch params directory, errno=%d", errno);
+    close(inotify_fd);
+    inotify_fd = -1;
+  }
+#endif
+  params_map = params.readAll();
+}
+
+InitDataCache::~InitDataCache() {
+  if (inotify_fd >= 0) close(inotify_fd);
+}
+
+bool InitDataCache::update_params() {
+#ifdef __linux__
+  if (inotify_fd >= 0) {
+    std::set<std::string> changed;
+    bool overflow = false;
+    alignas(struct inotify_event) char buf[4096];
+    ssize_t len;
+    while ((len = HANDLE_EINTR(read(inotify_fd, buf, sizeof(buf)))) > 0) {
+      for (char *ptr = buf; ptr < buf + len; ) {
+        auto event = (const struct inotify_event *)ptr;
+        ptr += sizeof(struct inotify_event) + event->len;
+
+        // lost track of what changed, start over
+        overflow |= (event->mask & IN_Q_OVERFLOW) != 0;
+        if (event->len > 0 && event->name[0] != '.') {
+          changed.insert(event->name);
+        }
+      }
+    }
 
+    if (overflow) {
+      params_map = params.readAll();
+      return true;
+    }
+    if (changed.empty()) return false;
+
+    // read the final state of the changed keys under the params lock
+    auto values = params.readKeys(std::vector<std::string>(changed.begin(), changed.end()));
+    for (const auto &key : changed) {
+      if (auto it = values.find(key); it != values.end()) {
+        params_map[key] = it->second;
+      } else {
+        params_map.erase(key);
+      }
+    }
+    return true;
   }
+#endif
+  params_map = params.readAll();
+  return true;
+}
+
+kj::Array<capnp::word> InitDataCache::build() {
+  MessageBuilder msg;
+  auto event = msg.initEvent();
+  event.setInitData(static_msg.getRoot<cereal::InitData>().asReader());
+  init_params(event.getInitData(), params, params_map);
+  return capnp::messageToFlatArray(msg);
+}
+
+kj::Array<capnp::word> logger_build_init_data() {
+  MessageBuilder msg;
+  auto init = msg.initEvent().initInitData();
+  init_static_data(init);
+
+  Params params;
+  std::map<std::string, std::string> params_map = params.readAll();
+  init_params(init, params, params_map);
   return capnp::messageToFlatArray(msg);
 }
 
@@ -135,7 +218,8 @@ void logger_init(LoggerState *s, const char* log_name, bool has_qlog) {
   s->has_qlog = has_qlog;
   s->route_name = logger_get_route_name();
   snprintf(s->log_name, sizeof(s->log_name), "%s", log_name);
-  s->init_data = logger_build_init_data();
+  s->init_data_cache = std::make_unique<InitDataCache>();
+  s->init_data = s->init_data_cache->build();
 }
 
 static LoggerHandle* logger_open(LoggerState *s, const char* root_path) {
@@ -180,6 +264,10 @@ int logger_next(LoggerState *s, const char* root_path,
 
   pthread_mutex_lock(&s->lock);
   s->part++;
+  if (s->part > 0 && s->init_data_cache->update_params()) {
+    // params changed during the previous segment, otherwise the initData of the route is reused
+    s->init_data = s->init_data_cache->build();
+  }
 
   LoggerHandle* next_h = logger_open(s, root_path);
   if (!next_h) {
@@ -219,10 +307,10 @@ LoggerHandle* logger_get_handle(LoggerState *s) {
   return h;
 }
 
-void logger_log(LoggerState *s, uint8_t* data, size_t data_size, bool in_qlog) {
+void logger_log(LoggerState *s, uint8_t* data, size_t data_size, bool in_qlog, bool in_rlog) {
   pthread_mutex_lock(&s->lock);
   if (s->cur_handle) {
-    lh_log(s->cur_handle, data, data_size, in_qlog);
+    lh_log(s->cur_handle, data, data_size, in_qlog, in_rlog);
   }
   pthread_mutex_unlock(&s->lock);
 }
@@ -237,10 +325,12 @@ void logger_close(LoggerState *s, ExitHandler *exit_handler) {
   pthread_mutex_unlock(&s->lock);
 }
 
-void lh_log(LoggerHandle* h, uint8_t* data, size_t data_size, bool in_qlog) {
+void lh_log(LoggerHandle* h, uint8_t* data, size_t data_size, bool in_qlog, bool in_rlog) {
   pthread_mutex_lock(&h->lock);
   assert(h->refcnt > 0);
-  h->log->write(data, data_size);
+  if (in_rlog) {
+    h->log->write(data, data_size);
+  }
   if (in_qlog && h->q_log) {
     h->q_log->write(data, data_size);
   }
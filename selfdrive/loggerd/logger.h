@@ -5,13 +5,16 @@
 
 #include <cstdint>
 #include <cstdio>
+#include <map>
 #include <memory>
+#include <string>
 
 #include <bzlib.h>
 #include <capnp/serialize.h>
 #include <kj/array.h>
 
 #include "cereal/messaging/messaging.h"
+#include "selfdrive/common/params.h"
 #include "selfdrive/common/util.h"
 #include "selfdrive/common/swaglog.h"
 #include "selfdrive/hardware/hw.h"
@@ -60,6 +63,25 @@ class BZFile {
 
 typedef cereal::Sentinel::SentinelType SentinelType;
 
+// Builds initData for the segments of a route without re-reading the world each time.
+// Device/kernel/version info is gathered once, params are read once and then
+// kept up to date from inotify events on the params directory.
+class InitDataCache {
+public:
+  InitDataCache();
+  ~InitDataCache();
+  // returns true if params changed since the last call
+  bool update_params();
+  kj::Array<capnp::word> build();
+
+private:
+
+  Params params;
+  capnp::MallocMessageBuilder static_msg;
+  std::map<std::string, std::string> params_map;
+  int inotify_fd = -1;
+};
+
 typedef struct LoggerHandle {
   pthread_mutex_t lock;
   SentinelType end_sentinel_type;
@@ -76,6 +98,7 @@ typedef struct LoggerState {
   pthread_mutex_t lock;
   int part;
   kj::Array<capnp::word> init_data;
+  std::unique_ptr<InitDataCache> init_data_cache;
   std::string route_name;
   char log_name[64];
   bool has_qlog;
@@ -92,8 +115,8 @@ int logger_next(LoggerState *s, const char* root_path,
                             int* out_part);
 LoggerHandle* logger_get_handle(LoggerState *s);
 void logger_close(LoggerState *s, ExitHandler *exit_handler=nullptr);
-void logger_log(LoggerState *s, uint8_t* data, size_t data_size, bool in_qlog);
+void logger_log(LoggerState *s, uint8_t* data, size_t data_size, bool in_qlog, bool in_rlog = true);
 
-void lh_log(LoggerHandle* h, uint8_t* data, size_t data_size, bool in_qlog);
+void lh_log(LoggerHandle* h, uint8_t* data, size_t data_size, bool in_qlog, bool in_rlog = true);
 void lh_close(LoggerHandle* h);
 void clear_locks(const std::string log_root);
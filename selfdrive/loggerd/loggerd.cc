@@ -37,13 +37,79 @@ bool trigger_rotate_if_needed(LoggerdState *s, int cur_seg, uint32_t frame_id) {
   return false;
 }
 
+// encodes frames for a secondary encoder (the qcamera) off the main encoder thread.
+// it encodes a frame for every frame of the main encoder, so frame indices in both files
+// match and the road encodeIdx also locates the qcamera frame.
+void encoder_worker_thread(const char *name, Encoder *e, EncoderWorker *w) {
+  util::set_thread_name(name);
+
+  int cur_seg = -1;
+  EncoderFrame *last = nullptr;
+  while (true) {
+    EncoderJob job = w->jobs.pop();
+    if (job.exit) break;
+
+    // follow the main encoder to the new segment so both files stay aligned
+    if (job.segment > cur_seg) {
+      cur_seg = job.segment;
+      e->encoder_close();
+      e->encoder_open(job.segment_path->c_str());
+    }
+
+    // the last frame is held back to be repeated in place of frames that couldn't be copied
+    if (job.frame) {
+      if (last) w->free_frames.push(last);
+      last = job.frame;
+    }
+    if (!last) continue;
+
+    const uint8_t *y = last->yuv.data();
+    const uint8_t *u = y + last->width * last->height;
+    const uint8_t *v = u + (last->width / 2) * (last->height / 2);
+    int out_id = e->encode_frame(y, u, v, last->width, last->height, job.extra.timestamp_eof);
+    if (out_id == -1) {
+      LOGE("Failed to encode frame. frame_id: %d", job.extra.frame_id);
+    }
+  }
+  if (last) w->free_frames.push(last);
+}
+
+void encoder_worker_push(EncoderWorker *w, VisionBuf *buf, const VisionIpcBufExtra &extra,
+                         int segment, const std::shared_ptr<const std::string> &segment_path) {
+  // a stuck worker shouldn't hold on to memory without bound. frames dropped here leave the
+  // qcamera shorter than the main encoder's file
+  if (w->jobs.size() >= ENCODER_WORKER_MAX_JOBS) {
+    LOGE("secondary encoder stuck, dropping frame %d", extra.frame_id);
+    return;
+  }
+
+  EncoderFrame *f = nullptr;
+  if (w->free_frames.try_pop(f)) {
+    const size_t y_size = buf->width * buf->height;
+    const size_t uv_size = (buf->width / 2) * (buf->height / 2);
+    f->yuv.resize(y_size + uv_size * 2);
+    memcpy(f->yuv.data(), buf->y, y_size);
+    memcpy(f->yuv.data() + y_size, buf->u, uv_size);
+    memcpy(f->yuv.data() + y_size + uv_size, buf->v, uv_size);
+    f->width = buf->width;
+    f->height = buf->height;
+  } else {
+    LOGE("secondary encoder lagging, repeating previous frame for %d", extra.frame_id);
+  }
+  w->jobs.push({.frame = f, .extra = extra, .segment = segment, .segment_path = segment_path});
+}
+
 void encoder_thread(LoggerdState *s, const LogCameraInfo &cam_info) {
   util::set_thread_name(cam_info.filename);
 
   int cur_seg = -1;
   int encode_idx = 0;
   LoggerHandle *lh = NULL;
-  std::vector<Encoder *> encoders;
+  std::shared_ptr<const std::string> segment_path;
+  Encoder *encoder = nullptr;
+  std::vector<Encoder *> sub_encoders;
+  std::vector<std::unique_ptr<EncoderWorker>> sub_workers;
+  std::vector<std::thread> sub_threads;
   VisionIpcClient vipc_client = VisionIpcClient("camerad", cam_info.stream_type, false);
 
   while (!do_exit) {
@@ -53,18 +119,25 @@ void encoder_thread(LoggerdState *s, const LogCameraInfo &cam_info) {
     }
 
     // init encoders
-    if (encoders.empty()) {
+    if (encoder == nullptr) {
       VisionBuf buf_info = vipc_client.buffers[0];
       LOGD("encoder init %dx%d", buf_info.width, buf_info.height);
 
       // main encoder
-      encoders.push_back(new Encoder(cam_info.filename, buf_info.width, buf_info.height,
-                                     cam_info.fps, cam_info.bitrate, cam_info.is_h265,
-                                     cam_info.downscale, cam_info.record));
+      encoder = new Encoder(cam_info.filename, buf_info.width, buf_info.height,
+                            cam_info.fps, cam_info.bitrate, cam_info.is_h265,
+                            cam_info.downscale, cam_info.record);
       // qcamera encoder
       if (cam_info.has_qcamera) {
-        encoders.push_back(new Encoder(qcam_info.filename, qcam_info.frame_width, qcam_info.frame_height,
-                                       qcam_info.fps, qcam_info.bitrate, qcam_info.is_h265, qcam_info.downscale));
+        sub_encoders.push_back(new Encoder(qcam_info.filename, qcam_info.frame_width, qcam_info.frame_height,
+                                           qcam_info.fps, qcam_info.bitrate, qcam_info.is_h265, qcam_info.downscale));
+      }
+
+      for (auto e : sub_encoders) {
+        auto w = std::make_unique<EncoderWorker>();
+        for (auto &f : w->frames) w->free_frames.push(&f);
+        sub_threads.push_back(std::thread(encoder_worker_thread, qcam_info.filename, e, w.get()));
+        sub_workers.push_back(std::move(w));
       }
     }
 
@@ -87,49 +160,49 @@ void encoder_thread(LoggerdState *s, const LogCameraInfo &cam_info) {
       // rotate the encoder if the logger is on a newer segment
       if (s->rotate_segment > cur_seg) {
         cur_seg = s->rotate_segment;
+        segment_path = std::make_shared<const std::string>(s->segment_path);
 
         LOGW("camera %d rotate encoder to %s", cam_info.type, s->segment_path);
-        for (auto &e : encoders) {
-          e->encoder_close();
-          e->encoder_open(s->segment_path);
-        }
+        encoder->encoder_close();
+        encoder->encoder_open(s->segment_path);
         if (lh) {
           lh_close(lh);
         }
         lh = logger_get_handle(&s->logger);
       }
 
-      // encode a frame
-      for (int i = 0; i < encoders.size(); ++i) {
-        int out_id = encoders[i]->encode_frame(buf->y, buf->u, buf->v,
-                                               buf->width, buf->height, extra.timestamp_eof);
+      // hand the frame to the secondary encoders, they rotate on the same frame as the main one
+      for (auto &w : sub_workers) {
+        encoder_worker_push(w.get(), buf, extra, cur_seg, segment_path);
+      }
 
-        if (out_id == -1) {
-          LOGE("Failed to encode frame. frame_id: %d encode_id: %d", extra.frame_id, encode_idx);
-        }
+      // encode a frame
+      int out_id = encoder->encode_frame(buf->y, buf->u, buf->v,
+                                         buf->width, buf->height, extra.timestamp_eof);
 
+      if (out_id == -1) {
+        LOGE("Failed to encode frame. frame_id: %d encode_id: %d", extra.frame_id, encode_idx);
+      } else {
         // publish encode index
-        if (i == 0 && out_id != -1) {
-          MessageBuilder msg;
-          // this is really ugly
-          bool valid = (buf->get_frame_id() == extra.frame_id);
-          auto eidx = cam_info.type == DriverCam ? msg.initEvent(valid).initDriverEncodeIdx() :
-                     (cam_info.type == WideRoadCam ? msg.initEvent(valid).initWideRoadEncodeIdx() : msg.initEvent(valid).initRoadEncodeIdx());
-          eidx.setFrameId(extra.frame_id);
-          eidx.setTimestampSof(extra.timestamp_sof);
-          eidx.setTimestampEof(extra.timestamp_eof);
-          if (Hardware::TICI()) {
-            eidx.setType(cereal::EncodeIndex::Type::FULL_H_E_V_C);
-          } else {
-            eidx.setType(cam_info.type == DriverCam ? cereal::EncodeIndex::Type::FRONT : cereal::EncodeIndex::Type::FULL_H_E_V_C);
-          }
-          eidx.setEncodeId(encode_idx);
-          eidx.setSegmentNum(cur_seg);
-          eidx.setSegmentId(out_id);
-          if (lh) {
-            auto bytes = msg.toBytes();
-            lh_log(lh, bytes.begin(), bytes.size(), true);
-          }
+        MessageBuilder msg;
+        // this is really ugly
+        bool valid = (buf->get_frame_id() == extra.frame_id);
+        auto eidx = cam_info.type == DriverCam ? msg.initEvent(valid).initDriverEncodeIdx() :
+                   (cam_info.type == WideRoadCam ? msg.initEvent(valid).initWideRoadEncodeIdx() : msg.initEvent(valid).initRoadEncodeIdx());
+        eidx.setFrameId(extra.frame_id);
+        eidx.setTimestampSof(extra.timestamp_sof);
+        eidx.setTimestampEof(extra.timestamp_eof);
+        if (Hardware::TICI()) {
+          eidx.setType(cereal::EncodeIndex::Type::FULL_H_E_V_C);
+        } else {
+          eidx.setType(cam_info.type == DriverCam ? cereal::EncodeIndex::Type::FRONT : cereal::EncodeIndex::Type::FULL_H_E_V_C);
+        }
+        eidx.setEncodeId(encode_idx);
+        eidx.setSegmentNum(cur_seg);
+        eidx.setSegmentId(out_id);
+        if (lh) {
+          auto bytes = msg.toBytes();
+          lh_log(lh, bytes.begin(), bytes.size(), true);
         }
       }
 
@@ -143,23 +216,60 @@ void encoder_thread(LoggerdState *s, const LogCameraInfo &cam_info) {
   }
 
   LOG("encoder destroy");
-  for(auto &e : encoders) {
+  for (auto &w : sub_workers) w->jobs.push({.exit = true});
+  for (auto &t : sub_threads) t.join();
+  for (auto &e : sub_encoders) {
     e->encoder_close();
     delete e;
   }
+  if (encoder) {
+    encoder->encoder_close();
+    delete encoder;
+  }
+}
+
+void can_log_flush(LoggerdState *s) {
+  if (s->can_log && !s->can_encoder.empty()) {
+    std::string block = s->can_encoder.finish();
+    s->can_log->write(block.data(), block.size());
+  }
+}
+
+void can_log_write(LoggerdState *s, Message *msg) {
+  capnp::FlatArrayMessageReader cmsg(s->aligned_buf.align(msg));
+  s->can_encoder.add(cmsg.getRoot<cereal::Event>());
+  if (s->can_encoder.full()) {
+    can_log_flush(s);
+  }
 }
 
 void logger_rotate(LoggerdState *s) {
+  const double start_tms = millis_since_boot();
   {
     std::unique_lock lk(s->rotate_lock);
+    if (LOGGERD_CAN_CODEC) {
+      // close the can log before the rlog lock goes away
+      can_log_flush(s);
+      s->can_log.reset(nullptr);
+    }
+
     int segment = -1;
     int err = logger_next(&s->logger, LOG_ROOT.c_str(), s->segment_path, sizeof(s->segment_path), &segment);
     assert(err == 0);
+    if (LOGGERD_CAN_CODEC) {
+      s->can_log = std::make_unique<BZFile>(util::string_format("%s/rcan.bz2", s->segment_path).c_str());
+    }
     s->rotate_segment = segment;
     s->ready_to_rotate = 0;
     s->last_rotate_tms = millis_since_boot();
   }
   s->rotate_cv.notify_all();
+  if (s->stats) {
+    const double dt = millis_since_boot() - start_tms;
+    s->stats->rotations++;
+    s->stats->rotate_ms_total += dt;
+    s->stats->rotate_ms_max = std::max(s->stats->rotate_ms_max, dt);
+  }
   LOGW((s->logger.part == 0) ? "logging to %s" : "rotated to %s", s->segment_path);
 }
 
@@ -177,11 +287,12 @@ void rotate_if_needed(LoggerdState *s) {
   }
 }
 
-void loggerd_thread() {
+void loggerd_thread(LoggerdStats *stats) {
   // setup messaging
   typedef struct QlogState {
     std::string name;
     int counter, freq;
+    bool columnar_can;
   } QlogState;
   std::unordered_map<SubSocket*, QlogState> qlog_states;
 
@@ -199,10 +310,12 @@ void loggerd_thread() {
       .name = it.name,
       .counter = 0,
       .freq = it.decimation,
+      .columnar_can = LOGGERD_CAN_CODEC && (strcmp(it.name, "can") == 0 || strcmp(it.name, "sendcan") == 0),
     };
   }
 
   LoggerdState s;
+  s.stats = stats;
   // init logger
   logger_init(&s.logger, "rlog", true);
   logger_rotate(&s);
@@ -231,7 +344,23 @@ void loggerd_thread() {
       Message *msg = nullptr;
       while (!do_exit && (msg = sock->receive(true))) {
         const bool in_qlog = qs.freq != -1 && (qs.counter++ % qs.freq == 0);
-        logger_log(&s.logger, (uint8_t *)msg->getData(), msg->getSize(), in_qlog);
+        const double write_start_tms = stats ? millis_since_boot() : 0;
+        if (qs.columnar_can) {
+          can_log_write(&s, msg);
+          if (in_qlog) {
+            logger_log(&s.logger, (uint8_t *)msg->getData(), msg->getSize(), true, false);
+          }
+        } else {
+          logger_log(&s.logger, (uint8_t *)msg->getData(), msg->getSize(), in_qlog);
+        }
+        if (stats) {
+          const double dt = millis_since_boot() - write_start_tms;
+          auto &ss = stats->services[qs.name];
+          ss.msgs++;
+          ss.bytes += msg->getSize();
+          ss.write_ms_total += dt;
+          ss.write_ms_max = std::max(ss.write_ms_max, dt);
+        }
         bytes_count += msg->getSize();
         delete msg;
 
@@ -256,6 +385,8 @@ void loggerd_thread() {
   for (auto &t : encoder_threads) t.join();
 
   LOGW("closing logger");
+  can_log_flush(&s);
+  s.can_log.reset(nullptr);
   logger_close(&s.logger, &do_exit);
 
   if (do_exit.power_failure) {
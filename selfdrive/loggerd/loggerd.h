@@ -6,10 +6,14 @@
 #include <cassert>
 #include <cerrno>
 #include <condition_variable>
+#include <cstring>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
 #include <unordered_map>
+#include <vector>
 
 #include "cereal/messaging/messaging.h"
 #include "cereal/services.h"
@@ -17,11 +21,13 @@
 #include "cereal/visionipc/visionipc_client.h"
 #include "selfdrive/camerad/cameras/camera_common.h"
 #include "selfdrive/common/params.h"
+#include "selfdrive/common/queue.h"
 #include "selfdrive/common/swaglog.h"
 #include "selfdrive/common/timing.h"
 #include "selfdrive/common/util.h"
 #include "selfdrive/hardware/hw.h"
 
+#include "selfdrive/loggerd/can_codec.h"
 #include "selfdrive/loggerd/encoder.h"
 #include "selfdrive/loggerd/logger.h"
 #if defined(QCOM) || defined(QCOM2)
@@ -40,6 +46,8 @@ const int DCAM_BITRATE = Hardware::TICI() ? MAIN_BITRATE : 2500000;
 
 const bool LOGGERD_TEST = getenv("LOGGERD_TEST");
 const int SEGMENT_LENGTH = LOGGERD_TEST ? atoi(getenv("LOGGERD_SEGMENT_LENGTH")) : 60;
+// log can/sendcan to a columnar rcan.bz2 next to the rlog instead of into the rlog
+const bool LOGGERD_CAN_CODEC = getenv("LOGGERD_CAN_CODEC");
 
 struct LogCameraInfo {
   CameraType type;
@@ -107,6 +115,44 @@ const LogCameraInfo qcam_info = {
   .frame_height = Hardware::TICI() ? 330 : 360 // keep pixel count the same?
 };
 
+// frames are copied out of VisionIPC for encoders on their own thread, camerad reuses its buffers
+#define ENCODER_WORKER_FRAMES 4
+// one second of frames, beyond that the worker is stuck rather than lagging
+#define ENCODER_WORKER_MAX_JOBS 20
+
+struct EncoderFrame {
+  std::vector<uint8_t> yuv;
+  int width, height;
+};
+
+struct EncoderJob {
+  // nullptr repeats the previous frame when the worker fell behind, so it keeps the
+  // same frame count as the main encoder
+  EncoderFrame *frame;
+  VisionIpcBufExtra extra;
+  int segment;
+  // shared by every job of the segment
+  std::shared_ptr<const std::string> segment_path;
+  bool exit = false;
+};
+
+struct EncoderWorker {
+  SafeQueue<EncoderJob> jobs;
+  SafeQueue<EncoderFrame *> free_frames;
+  EncoderFrame frames[ENCODER_WORKER_FRAMES];
+};
+
+// optional counters filled in by loggerd_thread, used by loggerd_bench
+struct LoggerdStats {
+  struct Service {
+    uint64_t msgs = 0, bytes = 0;
+    double write_ms_total = 0., write_ms_max = 0.;
+  };
+  std::map<std::string, Service> services;
+  int rotations = 0;
+  double rotate_ms_total = 0., rotate_ms_max = 0.;
+};
+
 struct LoggerdState {
   LoggerState logger = {};
   char segment_path[4096];
@@ -123,9 +169,17 @@ struct LoggerdState {
   std::atomic<uint32_t> start_frame_id = 0;
   bool camera_ready[WideRoadCam + 1] = {};
   bool camera_synced[WideRoadCam + 1] = {};
+
+  // columnar can log, only touched from the main logger thread
+  CanLogEncoder can_encoder;
+  std::unique_ptr<BZFile> can_log;
+  AlignedBuffer aligned_buf;
+
+  LoggerdStats *stats = nullptr;
 };
 
 bool sync_encoders(LoggerdState *s, CameraType cam_type, uint32_t frame_id);
 bool trigger_rotate_if_needed(LoggerdState *s, int cur_seg, uint32_t frame_id);
 void rotate_if_needed(LoggerdState *s);
-void loggerd_thread();
+void can_log_write(LoggerdState *s, Message *msg);
+void loggerd_thread(LoggerdStats *stats = nullptr);
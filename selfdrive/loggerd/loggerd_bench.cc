@@ -0,0 +1,286 @@
+// Synthetic-load benchmark for loggerd.
+//
+// usage: LOG_ROOT=/dev/shm/loggerd_bench ./loggerd_bench [seconds] [rlog.bz2]
+//
+// Runs loggerd_thread in-process against LOG_ROOT while publishing on every
+// logged service and sending synthetic camera frames over VisionIPC. With an
+// rlog, its messages are replayed in a loop at their original timing, so rates
+// and sizes match a real drive; otherwise every service publishes an empty
+// message at its nominal frequency. Set LOGGERD_TEST=1 LOGGERD_SEGMENT_LENGTH=n
+// to exercise rotation more often, and RAW_LOGGER_CODEC to pick the encoder.
+
+#include <dirent.h>
+#include <ftw.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <sstream>
+
+#include <capnp/dynamic.h>
+#include <capnp/schema.h>
+
+#include "cereal/visionipc/visionipc_server.h"
+#include "selfdrive/loggerd/loggerd.h"
+#include "selfdrive/ui/replay/util.h"
+
+extern ExitHandler do_exit;
+
+struct ScheduledMsg {
+  uint64_t offset_ns;
+  const char *service;
+  std::string bytes;
+};
+
+static const char *service_name(const std::string &name) {
+  for (const auto &it : services) {
+    if (it.should_log && name == it.name) return it.name;
+  }
+  return nullptr;
+}
+
+// one period of traffic taken from an rlog
+static std::vector<ScheduledMsg> schedule_from_rlog(const std::string &path, uint64_t &period_ns) {
+  std::vector<ScheduledMsg> schedule;
+  std::string raw = decompressBZ2(util::read_file(path));
+  if (raw.empty()) return schedule;
+
+  auto event_struct = capnp::Schema::from<cereal::Event>().asStruct();
+  std::map<uint16_t, const char *> which_to_service;
+  for (auto field : event_struct.getUnionFields()) {
+    which_to_service[field.getProto().getDiscriminantValue()] = service_name(field.getProto().getName());
+  }
+
+  kj::Array<capnp::word> words = kj::heapArray<capnp::word>(raw.size() / sizeof(capnp::word));
+  memcpy(words.begin(), raw.data(), words.size() * sizeof(capnp::word));
+  kj::ArrayPtr<const capnp::word> remaining = words;
+  uint64_t start_ns = 0, end_ns = 0;
+  try {
+    while (remaining.size() > 0) {
+      capnp::FlatArrayMessageReader reader(remaining);
+      auto event = reader.getRoot<cereal::Event>();
+      auto msg_words = kj::arrayPtr(remaining.begin(), reader.getEnd());
+      remaining = kj::arrayPtr(reader.getEnd(), remaining.end());
+
+      const char *service = which_to_service[event.which()];
+      if (service == nullptr) continue;
+
+      const uint64_t mono_time = event.getLogMonoTime();
+      if (start_ns == 0) start_ns = mono_time;
+      end_ns = std::max(end_ns, mono_time);
+      auto bytes = msg_words.asBytes();
+      schedule.push_back({mono_time - std::min(start_ns, mono_time), service, std::string((const char *)bytes.begin(), bytes.size())});
+    }
+  } catch (const kj::Exception &e) {
+    printf("stopped reading rlog: %s\n", e.getDescription().cStr());
+  }
+
+  std::stable_sort(schedule.begin(), schedule.end(), [](auto &l, auto &r) { return l.offset_ns < r.offset_ns; });
+  period_ns = std::max<uint64_t>(end_ns - start_ns, 1e9);
+  return schedule;
+}
+
+// one second of empty messages at each service's nominal rate
+static std::vector<ScheduledMsg> schedule_synthetic(uint64_t &period_ns) {
+  std::vector<ScheduledMsg> schedule;
+  auto event_struct = capnp::Schema::from<cereal::Event>().asStruct();
+  for (const auto &it : services) {
+    if (!it.should_log || it.frequency <= 0) continue;
+    KJ_IF_MAYBE(field, event_struct.findFieldByName(it.name)) {
+      MessageBuilder msg;
+      auto event = capnp::toDynamic(msg.initEvent());
+      auto type = field->getType();
+      if (type.isStruct()) {
+        event.init(*field);
+      } else if (type.isList() || type.isText() || type.isData()) {
+        event.init(*field, 0);
+      } else {
+        continue;
+      }
+
+      auto bytes = msg.toBytes();
+      for (int i = 0; i < it.frequency; ++i) {
+        schedule.push_back({(uint64_t)(i * 1e9 / it.frequency), it.name, std::string((const char *)bytes.begin(), bytes.size())});
+      }
+    }
+  }
+  std::stable_sort(schedule.begin(), schedule.end(), [](auto &l, auto &r) { return l.offset_ns < r.offset_ns; });
+  period_ns = 1e9;
+  return schedule;
+}
+
+static void publisher_thread(const std::vector<ScheduledMsg> &schedule, uint64_t period_ns,
+                             std::map<std::string, uint64_t> *published) {
+  util::set_thread_name("bench_pub");
+
+  std::vector<const char *> names;
+  for (const auto &it : services) {
+    if (it.should_log) names.push_back(it.name);
+  }
+  PubMaster pm(names);
+
+  const uint64_t start_ns = nanos_since_boot();
+  for (uint64_t loop = 0; !do_exit; ++loop) {
+    for (const auto &m : schedule) {
+      if (do_exit) break;
+
+      const int64_t wait_ns = (int64_t)(start_ns + loop * period_ns + m.offset_ns) - (int64_t)nanos_since_boot();
+      if (wait_ns > 0) precise_nano_sleep(wait_ns);
+      pm.send(m.service, (capnp::byte *)m.bytes.data(), m.bytes.size());
+      (*published)[m.service]++;
+    }
+  }
+}
+
+static void camera_thread(uint64_t *frames_sent) {
+  util::set_thread_name("bench_cam");
+
+  const int width = 1928, height = 1208;
+  std::vector<VisionStreamType> streams;
+  for (const auto &cam : cameras_logged) {
+    if (cam.enable) streams.push_back(cam.stream_type);
+  }
+
+  VisionIpcServer vipc_server("camerad");
+  for (auto type : streams) {
+    vipc_server.create_buffers(type, 20, false, width, height);
+  }
+  vipc_server.start_listener();
+
+  // noise keeps the encoders honest
+  std::mt19937 rng(0);
+  std::vector<uint8_t> noise(width * height * 3 / 2);
+  for (auto &b : noise) b = rng();
+
+  const uint64_t start_ns = nanos_since_boot();
+  for (uint32_t frame_id = 0; !do_exit; ++frame_id) {
+    const int64_t wait_ns = (int64_t)(start_ns + frame_id * (1e9 / MAIN_FPS)) - (int64_t)nanos_since_boot();
+    if (wait_ns > 0) precise_nano_sleep(wait_ns);
+
+    for (auto type : streams) {
+      VisionBuf *buf = vipc_server.get_buffer(type);
+      memcpy(buf->addr, noise.data(), std::min(buf->len, noise.size()));
+      VisionIpcBufExtra extra = {
+        .frame_id = frame_id,
+        .timestamp_sof = nanos_since_boot(),
+        .timestamp_eof = nanos_since_boot(),
+      };
+      vipc_server.send(buf, &extra, false);
+    }
+    (*frames_sent)++;
+  }
+}
+
+struct ThreadCpu {
+  std::string name;
+  double seconds;
+};
+
+static std::map<int, ThreadCpu> thread_cpu_times() {
+  std::map<int, ThreadCpu> ret;
+  const long ticks = sysconf(_SC_CLK_TCK);
+  DIR *d = opendir("/proc/self/task");
+  if (!d) return ret;
+
+  struct dirent *de = NULL;
+  while ((de = readdir(d))) {
+    if (de->d_name[0] == '.') continue;
+
+    std::string stat = util::read_file(util::string_format("/proc/self/task/%s/stat", de->d_name));
+    size_t lparen = stat.find('('), rparen = stat.rfind(')');
+    if (lparen == std::string::npos || rparen == std::string::npos) continue;
+
+    // utime and stime are the 12th and 13th fields after the command name
+    std::istringstream iss(stat.substr(rparen + 2));
+    std::string field;
+    unsigned long utime = 0, stime = 0;
+    for (int i = 0; i < 13 && iss >> field; ++i) {
+      if (i == 11) utime = std::stoul(field);
+      if (i == 12) stime = std::stoul(field);
+    }
+    ret[atoi(de->d_name)] = {stat.substr(lparen + 1, rparen - lparen - 1), (double)(utime + stime) / ticks};
+  }
+  closedir(d);
+  return ret;
+}
+
+static uint64_t bytes_on_disk = 0;
+static int sum_file_size(const char *fpath, const struct stat *sb, int typeflag) {
+  if (typeflag == FTW_F) bytes_on_disk += sb->st_size;
+  return 0;
+}
+
+// bytes in all files under LOG_ROOT
+static uint64_t log_root_size() {
+  bytes_on_disk = 0;
+  ftw(LOG_ROOT.c_str(), sum_file_size, 16);
+  return bytes_on_disk;
+}
+
+int main(int argc, char **argv) {
+  const int seconds = argc > 1 ? atoi(argv[1]) : 60;
+  const std::string rlog = argc > 2 ? argv[2] : "";
+
+  uint64_t period_ns = 0;
+  auto schedule = rlog.empty() ? schedule_synthetic(period_ns) : schedule_from_rlog(rlog, period_ns);
+  if (schedule.empty()) {
+    printf("nothing to publish\n");
+    return 1;
+  }
+  printf("logging to %s for %d s, %zu messages per %.1f s period\n", LOG_ROOT.c_str(), seconds, schedule.size(), period_ns / 1e9);
+
+  // LOG_ROOT may hold earlier runs, only what this one adds is counted
+  const uint64_t bytes_before = log_root_size();
+
+  LoggerdStats stats;
+  std::map<std::string, uint64_t> published;
+  uint64_t frames_sent = 0;
+
+  std::thread loggerd([&] {
+    util::set_thread_name("loggerd");
+    loggerd_thread(&stats);
+  });
+  // give loggerd time to subscribe before traffic starts
+  util::sleep_for(1000);
+  std::thread cam(camera_thread, &frames_sent);
+  std::thread pub(publisher_thread, std::cref(schedule), period_ns, &published);
+
+  auto cpu_start = thread_cpu_times();
+  const double start_tms = millis_since_boot();
+  while (!do_exit && (millis_since_boot() - start_tms) < seconds * 1000) {
+    util::sleep_for(100);
+  }
+  const double elapsed = (millis_since_boot() - start_tms) / 1000.;
+  auto cpu_end = thread_cpu_times();
+
+  do_exit = true;
+  pub.join();
+  cam.join();
+  loggerd.join();
+  const uint64_t bytes_written = log_root_size() - bytes_before;
+
+  printf("\n%-28s %10s %10s %8s %12s %12s\n", "service", "published", "logged", "dropped", "avg write ms", "max write ms");
+  uint64_t total_published = 0, total_logged = 0;
+  for (auto &[name, count] : published) {
+    const auto &ss = stats.services[name];
+    total_published += count;
+    total_logged += ss.msgs;
+    printf("%-28s %10lu %10lu %8ld %12.4f %12.4f\n", name.c_str(), count, ss.msgs, (long)count - (long)ss.msgs,
+           ss.msgs ? ss.write_ms_total / ss.msgs : 0., ss.write_ms_max);
+  }
+  printf("%-28s %10lu %10lu %8ld\n", "total", total_published, total_logged, (long)total_published - (long)total_logged);
+
+  printf("\n%-8s %-16s %10s\n", "tid", "thread", "cpu %");
+  for (auto &[tid, end] : cpu_end) {
+    auto it = cpu_start.find(tid);
+    const double used = end.seconds - (it != cpu_start.end() ? it->second.seconds : 0.);
+    printf("%-8d %-16s %10.1f\n", tid, end.name.c_str(), 100. * used / elapsed);
+  }
+
+  printf("\nframes sent: %lu per camera\n", frames_sent);
+  printf("bytes written: %.2f MB (%.2f MB/s)\n", bytes_written / 1e6, bytes_written / 1e6 / elapsed);
+  printf("rotations: %d, avg stall %.2f ms, max stall %.2f ms\n", stats.rotations,
+         stats.rotations ? stats.rotate_ms_total / stats.rotations : 0., stats.rotate_ms_max);
+  return 0;
+}
@@ -8,6 +8,7 @@
 #include <cassert>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 
 #define __STDC_CONSTANT_MACROS
 
@@ -17,6 +18,7 @@ extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/opt.h>
 }
 
 #include "selfdrive/common/swaglog.h"
@@ -24,34 +26,27 @@ extern "C" {
 
 RawLogger::RawLogger(const char* filename, int width, int height, int fps,
                      int bitrate, bool h265, bool downscale, bool write)
-  : filename(filename), fps(fps) {
+  : filename(filename), fps(fps), width(width), height(height), downscale(downscale) {
 
   // TODO: respect write arg
 
   av_register_all();
-  codec = avcodec_find_encoder(AV_CODEC_ID_FFVHUFF);
+  const std::string codec_name = util::getenv("RAW_LOGGER_CODEC", "ffvhuff");
+  codec = avcodec_find_encoder_by_name(codec_name.c_str());
+  if (!codec) {
+    LOGE("encoder %s not available, falling back to ffvhuff", codec_name.c_str());
+    codec = avcodec_find_encoder(AV_CODEC_ID_FFVHUFF);
+  }
   // codec = avcodec_find_encoder(AV_CODEC_ID_FFV1);
   assert(codec);
 
-  codec_ctx = avcodec_alloc_context3(codec);
-  assert(codec_ctx);
-  codec_ctx->width = width;
-  codec_ctx->height = height;
-  codec_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
-
-  // codec_ctx->thread_count = 2;
-
-  // ffv1enc doesn't respect AV_PICTURE_TYPE_I. make every frame a key frame for now.
-  // codec_ctx->gop_size = 0;
-
-  codec_ctx->time_base = (AVRational){ 1, fps };
-
-  int err = avcodec_open2(codec_ctx, codec, NULL);
-  assert(err >= 0);
+  preset = util::getenv("RAW_LOGGER_PRESET", "ultrafast");
+  crf = util::getenv("RAW_LOGGER_CRF", 23);
+  threads = util::getenv("RAW_LOGGER_THREADS", 0);
 
   frame = av_frame_alloc();
   assert(frame);
-  frame->format = codec_ctx->pix_fmt;
+  frame->format = AV_PIX_FMT_YUV420P;
   frame->width = width;
   frame->height = height;
   frame->linesize[0] = width;
@@ -61,12 +56,12 @@ RawLogger::RawLogger(const char* filename, int width, int height, int fps,
   if (downscale) {
     downscale_buf.resize(width * height * 3 / 2);
   }
+
 }
 
 RawLogger::~RawLogger() {
+  encoder_close();
   av_frame_free(&frame);
-  avcodec_close(codec_ctx);
-  av_free(codec_ctx);
 }
 
 void RawLogger::encoder_open(const char* path) {
@@ -81,10 +76,44 @@ void RawLogger::encoder_open(const char* path) {
   assert(lock_fd >= 0);
   close(lock_fd);
 
+  // a fresh codec context per segment, so delayed frames can be flushed on close
+  codec_ctx = avcodec_alloc_context3(codec);
+  assert(codec_ctx);
+  codec_ctx->width = width;
+  codec_ctx->height = height;
+  codec_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+  codec_ctx->thread_count = threads;
+  codec_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+  // ffv1enc doesn't respect AV_PICTURE_TYPE_I. make every frame a key frame for now.
+  // codec_ctx->gop_size = 0;
+
+  codec_ctx->time_base = (AVRational){ 1, fps };
+
+  if (codec->id == AV_CODEC_ID_H264 || codec->id == AV_CODEC_ID_HEVC) {
+    // one keyframe per second keeps replay seeking cheap
+    codec_ctx->gop_size = fps;
+    av_opt_set(codec_ctx->priv_data, "preset", preset.c_str(), 0);
+    av_opt_set_int(codec_ctx->priv_data, "crf", crf, 0);
+    // every preset but ultrafast turns on b-frames, which write packets in decode order.
+    // frames are numbered by their packet index, so they have to stay in display order.
+    codec_ctx->max_b_frames = 0;
+    if (codec->id == AV_CODEC_ID_HEVC) {
+      av_opt_set(codec_ctx->priv_data, "x265-params", "bframes=0", 0);
+    }
+  }
+
   format_ctx = NULL;
   avformat_alloc_output_context2(&format_ctx, NULL, "matroska", vid_path.c_str());
   assert(format_ctx);
 
+  if (format_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
+    codec_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+  }
+
+  int err = avcodec_open2(codec_ctx, codec, NULL);
+  assert(err >= 0);
+
   stream = avformat_new_stream(format_ctx, codec);
   // AVStream *stream = avformat_new_stream(format_ctx, NULL);
   assert(stream);
@@ -92,7 +121,7 @@ void RawLogger::encoder_open(const char* path) {
   stream->time_base = (AVRational){ 1, fps };
   // codec_ctx->time_base = stream->time_base;
 
-  int err = avcodec_parameters_from_context(stream->codecpar, codec_ctx);
+  err = avcodec_parameters_from_context(stream->codecpar, codec_ctx);
   assert(err >= 0);
 
   err = avio_open(&format_ctx->pb, vid_path.c_str(), AVIO_FLAG_WRITE);
@@ -103,15 +132,18 @@ void RawLogger::encoder_open(const char* path) {
 
   is_open = true;
   counter = 0;
+  pts = 0;
 }
 
 void RawLogger::encoder_close() {
   if (!is_open) return;
 
+  flush();
+
   int err = av_write_trailer(format_ctx);
   assert(err == 0);
 
-  avcodec_close(stream->codec);
+  avcodec_free_context(&codec_ctx);
 
   err = avio_closep(&format_ctx->pb);
   assert(err == 0);
@@ -125,11 +157,6 @@ void RawLogger::encoder_close() {
 
 int RawLogger::encode_frame(const uint8_t *y_ptr, const uint8_t *u_ptr, const uint8_t *v_ptr,
                             int in_width, int in_height, uint64_t ts) {
-  AVPacket pkt;
-  av_init_packet(&pkt);
-  pkt.data = NULL;
-  pkt.size = 0;
-
   if (downscale_buf.size() > 0) {
     uint8_t *out_y = downscale_buf.data();
     uint8_t *out_u = out_y + codec_ctx->width * codec_ctx->height;
@@ -151,8 +178,16 @@ int RawLogger::encode_frame(const uint8_t *y_ptr, const uint8_t *u_ptr, const ui
     frame->data[1] = (uint8_t*)u_ptr;
     frame->data[2] = (uint8_t*)v_ptr;
   }
-  frame->pts = counter;
+  frame->pts = pts++;
+
+  AVPacket pkt;
+  av_init_packet(&pkt);
+  pkt.data = NULL;
+  pkt.size = 0;
 
+  // with frame threads or lookahead the packet of this frame comes out of a later call
+  // or the flush. accepted frames become one packet each, in order, so counter is the
+  // index this frame's packet gets in the file. packets that fail to write give it back.
   int ret = counter;
 
   int got_output = 0;
@@ -160,19 +195,50 @@ int RawLogger::encode_frame(const uint8_t *y_ptr, const uint8_t *u_ptr, const ui
   if (err) {
     LOGE("encoding error\n");
     ret = -1;
-  } else if (got_output) {
-    av_packet_rescale_ts(&pkt, codec_ctx->time_base, stream->time_base);
-    pkt.stream_index = 0;
-
-    err = av_interleaved_write_frame(format_ctx, &pkt);
-    if (err < 0) {
-      LOGE("encoder writer error\n");
+  } else {
+    counter++;
+    if (got_output && !write_packet(&pkt)) {
+      counter--;
       ret = -1;
-    } else {
-      counter++;
     }
   }
 
   av_packet_unref(&pkt);
   return ret;
 }
+
+void RawLogger::flush() {
+  if (!codec_ctx) return;
+  // frame threaded codecs like ffvhuff hold frames in flight without AV_CODEC_CAP_DELAY
+  if (!(codec->capabilities & AV_CODEC_CAP_DELAY) && !(codec_ctx->active_thread_type & FF_THREAD_FRAME)) return;
+
+  // drain frames still buffered inside the codec (lookahead, frame threads)
+  int got_output = 1;
+  while (got_output) {
+    AVPacket pkt;
+    av_init_packet(&pkt);
+    pkt.data = NULL;
+    pkt.size = 0;
+
+    int err = avcodec_encode_video2(codec_ctx, &pkt, NULL, &got_output);
+    if (err) {
+      LOGE("encoder flush error\n");
+      got_output = 0;
+    } else if (got_output) {
+      write_packet(&pkt);
+    }
+    av_packet_unref(&pkt);
+  }
+}
+
+bool RawLogger::write_packet(AVPacket *pkt) {
+  av_packet_rescale_ts(pkt, codec_ctx->time_base, stream->time_base);
+  pkt->stream_index = 0;
+
+  int err = av_interleaved_write_frame(format_ctx, pkt);
+  if (err < 0) {
+    LOGE("encoder writer error\n");
+    return false;
+  }
+  return true;
+}
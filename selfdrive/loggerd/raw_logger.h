@@ -13,6 +13,12 @@ extern "C" {
 
 #include "selfdrive/loggerd/encoder.h"
 
+// software encoder used on PC. the codec is picked with environment variables:
+//   RAW_LOGGER_CODEC    ffvhuff (default, lossless), libx264 or libx265
+//   RAW_LOGGER_PRESET   x264/x265 preset, default "ultrafast"
+//   RAW_LOGGER_CRF      x264/x265 constant rate factor, default 23
+//   RAW_LOGGER_THREADS  ffmpeg frame/slice threads, default 0 (auto)
+// frames are encoded on the caller's thread, ffmpeg's frame threads run the codec in parallel.
 class RawLogger : public VideoEncoder {
  public:
   RawLogger(const char* filename, int width, int height, int fps,
@@ -24,10 +30,18 @@ class RawLogger : public VideoEncoder {
   void encoder_close();
 
 private:
+  void flush();
+  bool write_packet(AVPacket *pkt);
+
   const char* filename;
   //bool write;
   int fps;
+  int width, height;
+  bool downscale;
+  std::string preset;
+  int crf, threads;
   int counter = 0;
+  int pts = 0;
   bool is_open = false;
 
   std::string vid_path, lock_path;
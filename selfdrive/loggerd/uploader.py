@@ -72,7 +72,7 @@ class Uploader():
 
     self.immediate_folders = ["crash/", "boot/"]
     self.immediate_priority = {"qlog.bz2": 0, "qcamera.ts": 1}
-    self.high_priority = {"rlog.bz2": 0, "fcamera.hevc": 1, "dcamera.hevc": 2, "ecamera.hevc": 3}
+    self.high_priority = {"rlog.bz2": 0, "rcan.bz2": 1, "fcamera.hevc": 2, "dcamera.hevc": 3, "ecamera.hevc": 4}
 
   def get_upload_sort(self, name):
     if name in self.immediate_priority:
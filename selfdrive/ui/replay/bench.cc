@@ -0,0 +1,183 @@
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <QApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <iostream>
+
+#include "selfdrive/common/util.h"
+#include "selfdrive/ui/replay/replay.h"
+
+// benchmarks the replay stages on a local route, each on its own and end to end.
+// prints the metrics as json so runs can be compared across commits.
+
+namespace {
+
+double rssMB() {
+  // resident pages are the second field
+  std::string statm = util::read_file("/proc/self/statm");
+  long pages = 0;
+  sscanf(statm.c_str(), "%*ld %ld", &pages);
+  return pages * sysconf(_SC_PAGESIZE) / (1024.0 * 1024.0);
+}
+
+double peakRssMB() {
+  struct rusage usage = {};
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss / 1024.0;
+}
+
+double toMB(size_t bytes) {
+  return bytes / (1024.0 * 1024.0);
+}
+
+QJsonObject benchLog(const QString &file) {
+  QElapsedTimer timer;
+  const double rss = rssMB();
+  timer.start();
+  LogReader log;
+  bool ok = log.load(file.toStdString());
+  const double ms = timer.nsecsElapsed() / 1e6;
+  return {
+      {"file", file},
+      {"ok", ok},
+      {"load_ms", ms},
+      // events become available to the stream once the whole log is parsed
+      {"time_to_first_event_ms", ok ? ms : 0},
+      {"events", (int)log.events.size()},
+      {"events_per_sec", ms > 0 ? log.events.size() / (ms / 1e3) : 0},
+      {"memory_usage_mb", toMB(log.memoryUsage())},
+      {"rss_mb", rssMB() - rss},
+  };
+}
+
+QJsonObject benchFrames(const QString &file, int max_frames) {
+  QElapsedTimer timer;
+  const double rss = rssMB();
+  timer.start();
+  FrameReader fr;
+  bool ok = fr.load(file.toStdString(), true);
+  const double load_ms = timer.nsecsElapsed() / 1e6;
+
+  // decode in playback order, the way the camera server requests frames
+  int decoded = 0;
+  timer.restart();
+  const int count = std::min<int>(fr.getFrameCount(), max_frames);
+  for (int i = 0; ok && i < count; ++i) {
+    decoded += fr.getYUV(i) != nullptr;
+  }
+  const double decode_ms = timer.nsecsElapsed() / 1e6;
+  return {
+      {"file", file},
+      {"ok", ok},
+      {"width", fr.width},
+      {"height", fr.height},
+      {"load_ms", load_ms},
+      {"frames", decoded},
+      {"decode_ms", decode_ms},
+      {"frames_per_sec", decode_ms > 0 ? decoded / (decode_ms / 1e3) : 0},
+      {"memory_usage_mb", toMB(fr.memoryUsage())},
+      {"rss_mb", rssMB() - rss},
+  };
+}
+
+QJsonObject benchReplay(const QString &route, const QString &data_dir, uint32_t flags) {
+  QElapsedTimer timer;
+  QJsonObject result;
+  timer.start();
+  Replay replay(route, {}, {}, nullptr, flags | REPLAY_FLAG_HEADLESS | REPLAY_FLAG_NO_FILE_CACHE, data_dir);
+  if (!replay.load()) {
+    result["ok"] = false;
+    return result;
+  }
+  result["load_ms"] = timer.nsecsElapsed() / 1e6;
+
+  QEventLoop loop;
+  QObject::connect(&replay, &Replay::streamStarted, [&]() {
+    result["time_to_first_event_ms"] = timer.nsecsElapsed() / 1e6;
+  });
+  QObject::connect(&replay, &Replay::streamFinished, &loop, &QEventLoop::quit);
+  replay.start();
+  loop.exec();
+  replay.stop();
+
+  result["ok"] = true;
+  result["total_ms"] = timer.nsecsElapsed() / 1e6;
+  result["peak_rss_mb"] = peakRssMB();
+  return result;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  QApplication app(argc, argv);
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription("Benchmark replay on a local route and print the results as json.");
+  parser.addHelpOption();
+  parser.addPositionalArgument("route", "the route to benchmark");
+  parser.addOption({"data_dir", "local directory with the route", "data_dir"});
+  parser.addOption({"stages", "stages to run, comma separated: route,log,frame,replay", "stages", "route,log,frame,replay"});
+  parser.addOption({"segments", "number of segments to benchmark", "n", "1"});
+  parser.addOption({"frames", "number of frames to decode per segment", "n", "1200"});
+  parser.addOption({"qcam", "decode qcamera instead of the road camera"});
+  parser.process(app);
+
+  const QStringList args = parser.positionalArguments();
+  if (args.empty() || parser.value("data_dir").isEmpty()) {
+    parser.showHelp();
+  }
+  const QString route_name = args.first();
+  const QString data_dir = parser.value("data_dir");
+  const QStringList stages = parser.value("stages").split(",");
+  const int max_segments = parser.value("segments").toInt();
+  const int max_frames = parser.value("frames").toInt();
+  const bool qcam = parser.isSet("qcam");
+
+  QJsonObject result;
+  QElapsedTimer timer;
+  timer.start();
+  Route route(route_name, data_dir);
+  if (!route.load()) {
+    std::cerr << "failed to load route " << route_name.toStdString() << " from " << data_dir.toStdString() << std::endl;
+    return 1;
+  }
+  if (stages.contains("route")) {
+    result["route"] = QJsonObject{{"name", route_name}, {"load_ms", timer.nsecsElapsed() / 1e6}, {"segments", (int)route.segments().size()}};
+  }
+
+  QJsonArray logs, frames;
+  int n = 0;
+  for (const auto &[seg_num, files] : route.segments()) {
+    if (n++ >= max_segments) break;
+
+    const QString log_file = files.rlog.isEmpty() ? files.qlog : files.rlog;
+    if (stages.contains("log") && !log_file.isEmpty()) {
+      QJsonObject log = benchLog(log_file);
+      log["segment"] = seg_num;
+      logs.append(log);
+    }
+    const QString frame_file = qcam || files.road_cam.isEmpty() ? files.qcamera : files.road_cam;
+    if (stages.contains("frame") && !frame_file.isEmpty()) {
+      QJsonObject frame = benchFrames(frame_file, max_frames);
+      frame["segment"] = seg_num;
+      frames.append(frame);
+    }
+  }
+  if (stages.contains("log")) result["log"] = logs;
+  if (stages.contains("frame")) result["frame"] = frames;
+
+  if (stages.contains("replay")) {
+    // replays the whole route as fast as it can be streamed
+    result["replay"] = benchReplay(route_name, data_dir, (qcam ? REPLAY_FLAG_QCAMERA : REPLAY_FLAG_NONE) | REPLAY_FLAG_NO_CUDA | REPLAY_FLAG_NO_LOOP);
+  }
+  result["peak_rss_mb"] = peakRssMB();
+
+  std::cout << QJsonDocument(result).toJson().toStdString();
+  return 0;
+}
@@ -3,9 +3,16 @@
 #include <cassert>
 #include <iostream>
 
+#include "selfdrive/common/timing.h"
+
 const int YUV_BUF_COUNT = 50;
+// decode time relative to the frame interval, with hysteresis
+const float BEHIND_LOAD = 1.1;
+const float CAUGHT_UP_LOAD = 0.8;
+const float LOAD_SMOOTHING = 0.1;
 
-CameraServer::CameraServer(std::pair<int, int> camera_size[MAX_CAMERAS], bool send_yuv) : send_yuv(send_yuv) {
+CameraServer::CameraServer(std::pair<int, int> camera_size[MAX_CAMERAS], bool send_yuv, bool send_rgb)
+    : send_yuv(send_yuv), send_rgb(send_rgb) {
   for (int i = 0; i < MAX_CAMERAS; ++i) {
     std::tie(cameras_[i].width, cameras_[i].height) = camera_size[i];
   }
@@ -25,9 +32,15 @@ CameraServer::~CameraServer() {
 void CameraServer::startVipcServer() {
   vipc_server_.reset(new VisionIpcServer("camerad"));
   for (auto &cam : cameras_) {
+    // prefetched buffers belonged to the old server
+    cam.cached_fr = nullptr;
+    cam.cached_id = cam.cached_seg = -1;
+    cam.cached_buf = {};
     if (cam.width > 0 && cam.height > 0) {
       std::cout << "camera[" << cam.type << "] frame size " << cam.width << "x" << cam.height << std::endl;
-      vipc_server_->create_buffers(cam.rgb_type, UI_BUF_COUNT, true, cam.width, cam.height);
+      if (send_rgb) {
+        vipc_server_->create_buffers(cam.rgb_type, UI_BUF_COUNT, true, cam.width, cam.height);
+      }
       if (send_yuv) {
         vipc_server_->create_buffers(cam.yuv_type, YUV_BUF_COUNT, false, cam.width, cam.height);
       }
@@ -40,10 +53,13 @@ void CameraServer::startVipcServer() {
 }
 
 void CameraServer::cameraThread(Camera &cam) {
+  uint64_t decode_ns = 0;
   auto read_frame = [&](FrameReader *fr, int frame_id) {
-    VisionBuf *rgb_buf = vipc_server_->get_buffer(cam.rgb_type);
+    const uint64_t start_ts = nanos_since_boot();
+    VisionBuf *rgb_buf = send_rgb ? vipc_server_->get_buffer(cam.rgb_type) : nullptr;
     VisionBuf *yuv_buf = send_yuv ? vipc_server_->get_buffer(cam.yuv_type) : nullptr;
-    bool ret = fr->get(frame_id, (uint8_t *)rgb_buf->addr, yuv_buf ? (uint8_t *)yuv_buf->addr : nullptr);
+    bool ret = fr->get(frame_id, rgb_buf ? (uint8_t *)rgb_buf->addr : nullptr, yuv_buf ? (uint8_t *)yuv_buf->addr : nullptr);
+    decode_ns += nanos_since_boot() - start_ts;
     return ret ? std::pair{rgb_buf, yuv_buf} : std::pair{nullptr, nullptr};
   };
 
@@ -51,8 +67,16 @@ void CameraServer::cameraThread(Camera &cam) {
     const auto [fr, eidx] = cam.queue.pop();
     if (!fr) break;
 
+    // a newer frame is already waiting, showing this one would only add to the delay
+    if (--cam.queued > 0 && cam.behind) {
+      ++cam.dropped;
+      --publishing_;
+      continue;
+    }
+
+    decode_ns = 0;
     const int id = eidx.getSegmentId();
-    bool prefetched = (id == cam.cached_id && eidx.getSegmentNum() == cam.cached_seg);
+    bool prefetched = (fr == cam.cached_fr && id == cam.cached_id && eidx.getSegmentNum() == cam.cached_seg);
     auto [rgb, yuv] = prefetched ? cam.cached_buf : read_frame(fr, id);
     if (rgb || yuv) {
       VisionIpcBufExtra extra = {
@@ -66,10 +90,22 @@ void CameraServer::cameraThread(Camera &cam) {
       std::cout << "camera[" << cam.type << "] failed to get frame:" << eidx.getSegmentId() << std::endl;
     }
 
+    cam.cached_fr = fr;
     cam.cached_id = id + 1;
     cam.cached_seg = eidx.getSegmentNum();
     cam.cached_buf = read_frame(fr, cam.cached_id);
 
+    cam.decode_ms += (decode_ns / 1e6 - cam.decode_ms) * LOAD_SMOOTHING;
+    const float load = cam.interval_ms > 0 ? cam.decode_ms / cam.interval_ms : 0;
+    if (!cam.behind && load > BEHIND_LOAD) {
+      cam.behind = true;
+      std::cout << "camera[" << cam.type << "] decoding falls behind, " << cam.decode_ms << "ms per frame" << std::endl;
+    } else if (cam.behind && load < CAUGHT_UP_LOAD) {
+      cam.behind = false;
+      std::cout << "camera[" << cam.type << "] caught up, dropped " << cam.dropped << " frames" << std::endl;
+      cam.dropped = 0;
+    }
+
     --publishing_;
   }
 }
@@ -83,6 +119,15 @@ void CameraServer::pushFrame(CameraType type, FrameReader *fr, const cereal::Enc
     startVipcServer();
   }
 
+  // pauses and seeks aren't part of the frame rate
+  const uint64_t ts = nanos_since_boot();
+  const float interval_ms = (ts - cam.last_push_ts) / 1e6;
+  if (cam.last_push_ts > 0 && interval_ms < 1000) {
+    cam.interval_ms = cam.interval_ms > 0 ? cam.interval_ms + (interval_ms - cam.interval_ms) * LOAD_SMOOTHING : interval_ms;
+  }
+  cam.last_push_ts = ts;
+
   ++publishing_;
+  ++cam.queued;
   cam.queue.push({fr, eidx});
 }
@@ -8,12 +8,15 @@
 
 class CameraServer {
 public:
-  CameraServer(std::pair<int, int> camera_size[MAX_CAMERAS] = nullptr, bool send_yuv = false);
+  CameraServer(std::pair<int, int> camera_size[MAX_CAMERAS] = nullptr, bool send_yuv = false, bool send_rgb = true);
   ~CameraServer();
   void pushFrame(CameraType type, FrameReader* fr, const cereal::EncodeIndex::Reader& eidx);
   inline void waitFinish() {
     while (publishing_ > 0) usleep(0);
   }
+  // true while decoding takes longer than the frames of the camera arrive. frames that are
+  // already late when their turn comes are dropped until it catches up.
+  inline bool isBehind(CameraType type) const { return cameras_[type].behind; }
 
 protected:
   struct Camera {
@@ -24,9 +27,19 @@ protected:
     int height;
     std::thread thread;
     SafeQueue<std::pair<FrameReader*, const cereal::EncodeIndex::Reader>> queue;
+    // the frame after the last one sent is decoded ahead, keyed by its reader as road and
+    // qcamera frames of a segment share ids
+    FrameReader *cached_fr = nullptr;
     int cached_id = -1;
     int cached_seg = -1;
     std::pair<VisionBuf *, VisionBuf*> cached_buf;
+    // smoothed decode time and interval between pushed frames, in ms
+    float decode_ms = 0;
+    std::atomic<float> interval_ms = 0;
+    uint64_t last_push_ts = 0;
+    std::atomic<int> queued = 0;
+    std::atomic<bool> behind = false;
+    int dropped = 0;
   };
   void startVipcServer();
   void cameraThread(Camera &cam);
@@ -39,4 +52,5 @@ protected:
   std::atomic<int> publishing_ = 0;
   std::unique_ptr<VisionIpcServer> vipc_server_;
   bool send_yuv;
+  bool send_rgb;
 };
@@ -0,0 +1,212 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDir>
+#include <QFileInfo>
+
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <thread>
+
+#include "opendbc/can/common.h"
+#include "selfdrive/common/util.h"
+#include "selfdrive/ui/replay/logreader.h"
+#include "selfdrive/ui/replay/route.h"
+#include "selfdrive/ui/replay/util.h"
+
+// decodes the can messages of rlogs with a DBC and exports the signals as time series, one table
+// per message: <out>/<segment>/<message>/logMonoTime.npy and <signal>.npy, like logexport.
+
+namespace {
+
+struct Selection {
+  std::vector<MessageParseOptions> messages;
+  std::vector<SignalParseOptions> signals;
+  std::map<uint32_t, std::string> names;
+};
+
+// "MESSAGE" selects all signals of a message, "MESSAGE:SIGNAL" a single one. messages are
+// given by name or address. nothing selects the whole DBC.
+bool selectSignals(const DBC *dbc, const QStringList &list, Selection &sel) {
+  auto add = [&](const Msg &msg, const char *signal) {
+    if (sel.names.count(msg.address) == 0) {
+      sel.messages.push_back({.address = msg.address, .check_frequency = 0});
+      sel.names[msg.address] = msg.name;
+    }
+    for (int i = 0; i < msg.num_sigs; ++i) {
+      const Signal &sig = msg.sigs[i];
+      if (sig.type == SignalType::DEFAULT && (!signal || strcmp(signal, sig.name) == 0)) {
+        sel.signals.push_back({.address = msg.address, .name = sig.name});
+        if (signal) return true;
+      }
+    }
+    return signal == nullptr;
+  };
+
+  if (list.empty()) {
+    for (int i = 0; i < dbc->num_msgs; ++i) {
+      add(dbc->msgs[i], nullptr);
+    }
+    return true;
+  }
+
+  for (const QString &item : list) {
+    const QStringList parts = item.split(":");
+    bool is_address = false;
+    const uint32_t address = parts[0].toUInt(&is_address, 0);
+    const Msg *msg = nullptr;
+    for (int i = 0; i < dbc->num_msgs && !msg; ++i) {
+      if ((is_address && dbc->msgs[i].address == address) || parts[0] == dbc->msgs[i].name) {
+        msg = &dbc->msgs[i];
+      }
+    }
+    if (!msg) {
+      std::cerr << "no message " << parts[0].toStdString() << " in " << dbc->name << std::endl;
+      return false;
+    }
+    const std::string signal = parts.size() > 1 ? parts[1].toStdString() : "";
+    if (!add(*msg, parts.size() > 1 ? signal.c_str() : nullptr)) {
+      std::cerr << "no signal " << signal << " in " << msg->name << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+bool exportSegment(const std::string &log_file, const std::string &out_dir, const std::string &dbc_name,
+                   int bus, bool sendcan, const Selection &sel, std::mutex &parser_lock) {
+  LogReader log;
+  if (!log.load(log_file)) {
+    std::cerr << "failed to read " << log_file << std::endl;
+    return false;
+  }
+  if (auto can_log = canLogPath(log_file); !can_log.empty() && !log.loadCanLog(can_log)) {
+    std::cerr << "failed to read " << can_log << std::endl;
+    return false;
+  }
+
+  std::unique_ptr<CANParser> parser;
+  {
+    // the parser sets up the shared crc tables
+    std::lock_guard lk(parser_lock);
+    parser = std::make_unique<CANParser>(bus, dbc_name, sel.messages, sel.signals);
+  }
+  std::set<std::pair<uint32_t, std::string>> selected;
+  for (const auto &s : sel.signals) {
+    selected.insert({s.address, s.name});
+  }
+
+  struct Table {
+    std::string times;
+    std::map<std::string, std::string> values;
+  };
+  std::map<uint32_t, Table> tables;
+  const auto which = sendcan ? cereal::Event::SENDCAN : cereal::Event::CAN;
+  for (const Event *e : log.events) {
+    if (e->which != which) continue;
+
+    parser->UpdateCans(e->mono_time, sendcan ? e->event.getSendcan() : e->event.getCan());
+    parser->last_sec = e->mono_time;
+    for (const auto &sv : parser->query_latest()) {
+      // checksums and counters are parsed too, but only to validate the messages
+      if (sv.all_values.empty() || selected.count({sv.address, sv.name}) == 0) continue;
+
+      auto &table = tables[sv.address];
+      auto &values = table.values[sv.name];
+      values.append((const char *)sv.all_values.data(), sv.all_values.size() * sizeof(double));
+      // all signals of a message are parsed together and share the timestamps
+      while (table.times.size() / sizeof(uint64_t) < values.size() / sizeof(double)) {
+        table.times.append((const char *)&e->mono_time, sizeof(e->mono_time));
+      }
+    }
+  }
+
+  bool ok = true;
+  for (const auto &[address, table] : tables) {
+    const std::string dir = out_dir + "/" + sel.names.at(address);
+    if (!util::create_directories(dir, 0755)) {
+      std::cerr << "failed to create " << dir << std::endl;
+      return false;
+    }
+    const size_t count = table.times.size() / sizeof(uint64_t);
+    ok &= writeNpy(dir + "/logMonoTime.npy", "<u8", count, table.times);
+    for (const auto &[name, values] : table.values) {
+      ok &= writeNpy(dir + "/" + name + ".npy", "<f8", count, values);
+    }
+  }
+  return ok;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  QCoreApplication app(argc, argv);
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription("Decode the can messages of rlogs with a DBC and export the signals as .npy time series.");
+  parser.addHelpOption();
+  parser.addPositionalArgument("logs", "rlog files, or a route with --data_dir", "logs...");
+  parser.addOption({"data_dir", "local directory with the route", "data_dir"});
+  parser.addOption({"dbc", "name of the DBC in opendbc", "dbc"});
+  parser.addOption({"bus", "can bus to decode", "bus", "0"});
+  parser.addOption({{"s", "signals"}, "messages or message:signal pairs to export, all of the DBC by default", "signals"});
+  parser.addOption({"sendcan", "decode sendcan instead of can"});
+  parser.addOption({{"o", "out"}, "output directory", "out"});
+  parser.addOption({{"j", "jobs"}, "segments decoded at once", "jobs", QString::number(std::thread::hardware_concurrency())});
+  parser.process(app);
+
+  const QStringList args = parser.positionalArguments();
+  if (args.empty() || parser.value("dbc").isEmpty() || parser.value("out").isEmpty()) {
+    parser.showHelp(1);
+  }
+
+  const std::string dbc_name = parser.value("dbc").toStdString();
+  const DBC *dbc = dbc_lookup(dbc_name);
+  if (!dbc) {
+    std::cerr << "unknown DBC " << dbc_name << std::endl;
+    return 1;
+  }
+  Selection sel;
+  const QStringList signal_list = parser.value("signals").isEmpty() ? QStringList{} : parser.value("signals").split(",");
+  if (!selectSignals(dbc, signal_list, sel)) return 1;
+
+  // segments are named after the directory of their log
+  std::vector<std::pair<std::string, std::string>> segments;
+  if (!parser.value("data_dir").isEmpty()) {
+    Route route(args.first(), parser.value("data_dir"));
+    if (!route.load()) {
+      std::cerr << "failed to load route " << args.first().toStdString() << std::endl;
+      return 1;
+    }
+    for (const auto &[n, files] : route.segments()) {
+      // qlogs only have a sample of the can messages
+      if (!files.rlog.isEmpty()) {
+        segments.push_back({files.rlog.toStdString(), QFileInfo(files.rlog).dir().dirName().toStdString()});
+      }
+    }
+  } else {
+    for (const QString &log : args) {
+      if (log.startsWith("http://") || log.startsWith("https://")) {
+        std::cerr << "only local logs can be decoded: " << log.toStdString() << std::endl;
+        return 1;
+      }
+      segments.push_back({log.toStdString(), QFileInfo(log).dir().dirName().toStdString()});
+    }
+  }
+
+  const std::string out_dir = parser.value("out").toStdString();
+  const int bus = parser.value("bus").toInt();
+  const bool sendcan = parser.isSet("sendcan");
+  std::atomic<int> failed = 0;
+  std::mutex print_lock, parser_lock;
+  parallelFor(segments.size(), parser.value("jobs").toInt(), [&](int n) {
+    const auto &[log, name] = segments[n];
+    bool ok = exportSegment(log, out_dir + "/" + name, dbc_name, bus, sendcan, sel, parser_lock);
+    failed += !ok;
+    std::lock_guard lk(print_lock);
+    std::cout << (ok ? "decoded " : "failed to decode ") << log << std::endl;
+  });
+  return failed > 0;
+}
@@ -1,36 +1,83 @@
 #include "selfdrive/ui/replay/filereader.h"
 
-#include <fstream>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
 #include <iostream>
+#include <vector>
 
 #include "selfdrive/common/util.h"
 #include "selfdrive/ui/replay/util.h"
 
-std::string cacheFilePath(const std::string &url) {
+const std::string &cacheDirectory() {
   static std::string cache_path = [] {
     const std::string comma_cache = util::getenv("COMMA_CACHE", "/tmp/comma_download_cache/");
     util::create_directories(comma_cache, 0755);
     return comma_cache.back() == '/' ? comma_cache : comma_cache + "/";
   }();
+  return cache_path;
+}
 
-  return cache_path + sha256(getUrlWithoutQuery(url));
+std::string cacheFilePath(const std::string &url) {
+  return cacheDirectory() + sha256(getUrlWithoutQuery(url));
 }
 
-std::string FileReader::read(const std::string &file, std::atomic<bool> *abort) {
-  const bool is_remote = file.find("https://") == 0;
-  const std::string local_file = is_remote ? cacheFilePath(file) : file;
-  std::string result;
+// class FileData
+
+FileData &FileData::operator=(FileData &&other) {
+  std::swap(addr_, other.addr_);
+  std::swap(size_, other.size_);
+  std::swap(buf_, other.buf_);
+  return *this;
+}
+
+FileData::~FileData() {
+  if (addr_) {
+    munmap(addr_, size_);
+  }
+}
 
-  if ((!is_remote || cache_to_local_) && util::file_exists(local_file)) {
-    result = util::read_file(local_file);
-  } else if (is_remote) {
-    result = download(file, abort);
-    if (cache_to_local_ && !result.empty()) {
-      std::ofstream fs(local_file, std::ios::binary | std::ios::out);
-      fs.write(result.data(), result.size());
+FileData FileData::map(const std::string &path) {
+  FileData data;
+  int fd = HANDLE_EINTR(open(path.c_str(), O_RDONLY));
+  if (fd < 0) return data;
+
+  struct stat st = {};
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr != MAP_FAILED) {
+      data.addr_ = addr;
+      data.size_ = st.st_size;
     }
   }
-  return result;
+  close(fd);
+  return data;
+}
+
+// class FileReader
+
+std::string FileReader::read(const std::string &file, std::atomic<bool> *abort) {
+  FileData data = map(file, abort);
+  return std::string((const char *)data.data(), data.size());
+}
+
+FileData FileReader::map(const std::string &file, std::atomic<bool> *abort) {
+  const bool is_remote = file.find("https://") == 0 || file.find("http://") == 0;
+  if (!is_remote) {
+    return FileData::map(file);
+  }
+  if (cache_to_local_) {
+    std::string local_file = FileCache::instance().fetch(file, chunk_size_, max_retries_, abort);
+    return local_file.empty() ? FileData() : FileData::map(local_file);
+  }
+  return FileData(download(file, abort));
 }
 
 std::string FileReader::download(const std::string &url, std::atomic<bool> *abort) {
@@ -45,3 +92,195 @@ std::string FileReader::download(const std::string &url, std::atomic<bool> *abor
   }
   return {};
 }
+
+// class FileCache
+
+FileCache &FileCache::instance() {
+  static FileCache cache;
+  return cache;
+}
+
+FileCache::FileCache() {
+  max_size_ = (size_t)std::max(util::getenv("COMMA_CACHE_SIZE", 10 * 1024), 0) * 1024 * 1024;
+}
+
+namespace {
+
+// flock on path, created if needed. returns the fd holding the lock or -1. evict() unlinks lock
+// files while holding them, so a lock taken on a file that was unlinked in between is retried.
+int lockFile(const std::string &path, bool block) {
+  while (true) {
+    int fd = HANDLE_EINTR(open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0664));
+    if (fd < 0) return -1;
+    if (HANDLE_EINTR(flock(fd, block ? LOCK_EX : LOCK_EX | LOCK_NB)) != 0) {
+      close(fd);
+      return -1;
+    }
+    struct stat fd_st = {}, path_st = {};
+    if (fstat(fd, &fd_st) == 0 && stat(path.c_str(), &path_st) == 0 && fd_st.st_ino == path_st.st_ino) {
+      return fd;
+    }
+    close(fd);
+  }
+}
+
+bool isHash(const std::string &name) {
+  return name.size() == 64 && std::all_of(name.begin(), name.end(), [](char c) { return isxdigit(c); });
+}
+
+}  // namespace
+
+std::string FileCache::fetch(const std::string &url, size_t chunk_size, int retries, std::atomic<bool> *abort) {
+  const std::string key = cacheFilePath(url);
+  // one download of a url at a time, across threads and processes sharing the cache
+  int lock_fd = lockFile(key + ".lock", true);
+  if (lock_fd < 0) return "";
+
+  std::string path = lookup(key);
+  if (path.empty()) {
+    path = download(url, key, chunk_size, retries, abort);
+  }
+  if (!path.empty()) {
+    // mtime orders the files for eviction
+    utimes(path.c_str(), nullptr);
+  }
+  close(lock_fd);
+
+  if (!path.empty()) {
+    evict(path);
+  }
+  return path;
+}
+
+std::string FileCache::lookup(const std::string &key) {
+  const std::string hash = util::read_file(key + ".ref");
+  if (!isHash(hash)) return "";
+
+  const std::string path = cacheDirectory() + hash;
+  return util::file_exists(path) && verify(path) ? path : "";
+}
+
+std::string FileCache::download(const std::string &url, const std::string &key, size_t chunk_size, int retries, std::atomic<bool> *abort) {
+  const std::string part = key + ".part";
+  bool ok = false;
+  for (int i = 0; i <= retries && !ok && !(abort && *abort); ++i) {
+    if (i > 0) {
+      std::cout << "download failed, retrying " << i << std::endl;
+    }
+    ok = httpDownload(url, part, chunk_size, abort);
+  }
+  if (!ok) return "";
+
+  FileData data = FileData::map(part);
+  if (data.empty()) return "";
+  const std::string hash = sha256(data.data(), data.size());
+  const std::string path = cacheDirectory() + hash;
+
+  // the file goes in place before the url points to it, so readers never see a partial file.
+  // it replaces an identical one if another url had the same content.
+  const std::string ref = key + ".ref";
+  if (rename(part.c_str(), path.c_str()) != 0 ||
+      util::write_file((ref + ".tmp").c_str(), hash.data(), hash.size(), O_WRONLY | O_CREAT | O_TRUNC) != 0 ||
+      rename((ref + ".tmp").c_str(), ref.c_str()) != 0) {
+    return "";
+  }
+
+  std::lock_guard lk(lock_);
+  verified_.insert(path);
+  return path;
+}
+
+bool FileCache::verify(const std::string &path) {
+  {
+    std::lock_guard lk(lock_);
+    if (verified_.count(path)) return true;
+  }
+
+  // the name is the checksum
+  FileData data = FileData::map(path);
+  if (data.empty() || path.compare(path.size() - 64, 64, sha256(data.data(), data.size())) != 0) {
+    std::cout << "removing corrupt cache file " << path << std::endl;
+    unlink(path.c_str());
+    return false;
+  }
+
+  std::lock_guard lk(lock_);
+  verified_.insert(path);
+  return true;
+}
+
+void FileCache::evict(const std::string &keep) {
+  struct Entry {
+    std::string path;
+    uint64_t mtime;
+    size_t size;
+    bool part;
+  };
+  std::vector<Entry> entries;
+  std::vector<std::string> refs;
+  size_t total = 0;
+
+  const std::string &dir = cacheDirectory();
+  DIR *d = opendir(dir.c_str());
+  if (!d) return;
+
+  struct dirent *de = nullptr;
+  while ((de = readdir(d))) {
+    const std::string name = de->d_name;
+    struct stat st = {};
+    if (name[0] == '.' || stat((dir + name).c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+
+    total += st.st_size;
+    // downloads that were given up on leave a .part behind, it goes by its mtime like the files
+    const bool part = name.size() == 69 && name.compare(64, 5, ".part") == 0;
+    if (isHash(name) || part) {
+      entries.push_back({dir + name, st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec, (size_t)st.st_size, part});
+    } else if (name.size() == 68 && name.compare(64, 4, ".ref") == 0) {
+      refs.push_back(dir + name.substr(0, 64));
+    }
+  }
+  closedir(d);
+  if (total <= max_size_) return;
+
+  std::sort(entries.begin(), entries.end(), [](auto &l, auto &r) { return l.mtime < r.mtime; });
+  bool evicted = false;
+  for (auto it = entries.begin(); it != entries.end() && total > max_size_; ++it) {
+    if (it->path == keep) continue;
+
+    int lock_fd = -1;
+    // a .part is named after the url it downloads
+    const std::string key = it->part ? it->path.substr(0, it->path.size() - 5) : "";
+    if (it->part) {
+      // locked by the process downloading it
+      lock_fd = lockFile(key + ".lock", false);
+      if (lock_fd < 0) continue;
+    }
+
+    // mapped files stay readable after they are unlinked
+    std::cout << "evicting " << it->path << " from cache" << std::endl;
+    unlink(it->path.c_str());
+    if (it->part) {
+      unlink((it->path + ".offset").c_str());
+      if (!util::file_exists(key + ".ref")) unlink((key + ".lock").c_str());
+      close(lock_fd);
+    } else {
+      std::lock_guard lk(lock_);
+      verified_.erase(it->path);
+    }
+    total -= it->size;
+    evicted = true;
+  }
+
+  // urls whose file is gone are downloaded again, their index goes with the file
+  for (const auto &key : evicted ? refs : std::vector<std::string>{}) {
+    int lock_fd = lockFile(key + ".lock", false);
+    if (lock_fd < 0) continue;
+
+    const std::string hash = util::read_file(key + ".ref");
+    if (!isHash(hash) || !util::file_exists(dir + hash)) {
+      unlink((key + ".ref").c_str());
+      unlink((key + ".lock").c_str());
+    }
+    close(lock_fd);
+  }
+}
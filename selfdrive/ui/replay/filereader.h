@@ -1,14 +1,38 @@
 #pragma once
 
 #include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <set>
 #include <string>
 
+// read-only contents of a file. files on disk are mmap'd, downloads that aren't cached are kept in memory.
+class FileData {
+public:
+  FileData() = default;
+  explicit FileData(std::string buf) : buf_(std::move(buf)) {}
+  FileData(FileData &&other) { *this = std::move(other); }
+  FileData &operator=(FileData &&other);
+  ~FileData();
+  static FileData map(const std::string &path);
+
+  inline const std::byte *data() const { return addr_ ? (const std::byte *)addr_ : (const std::byte *)buf_.data(); }
+  inline size_t size() const { return addr_ ? size_ : buf_.size(); }
+  inline bool empty() const { return size() == 0; }
+
+private:
+  void *addr_ = nullptr;
+  size_t size_ = 0;
+  std::string buf_;
+};
+
 class FileReader {
 public:
   FileReader(bool cache_to_local, size_t chunk_size = 0, int retries = 3)
       : cache_to_local_(cache_to_local), chunk_size_(chunk_size), max_retries_(retries) {}
   virtual ~FileReader() {}
   std::string read(const std::string &file, std::atomic<bool> *abort = nullptr);
+  FileData map(const std::string &file, std::atomic<bool> *abort = nullptr);
 
 private:
   std::string download(const std::string &url, std::atomic<bool> *abort);
@@ -17,4 +41,34 @@ private:
   bool cache_to_local_;
 };
 
+// local cache of downloaded files, content addressed: a file is stored under the sha256 of its
+// contents and <url hash>.ref names the file of a url. downloads go to <url hash>.part and are
+// resumed from there after an interruption. a finished download is renamed into place before its
+// .ref is written, so readers never see a partial file, and files are checked against their name
+// the first time a process uses them. processes sharing the cache flock <url hash>.lock while
+// they download a url. once the cache grows past COMMA_CACHE_SIZE MB (default 10GB), the least
+// recently used files are removed, abandoned .part files included.
+class FileCache {
+public:
+  static FileCache &instance();
+  // local path of a verified copy of url, downloading it if needed. empty on failure.
+  std::string fetch(const std::string &url, size_t chunk_size, int retries, std::atomic<bool> *abort);
+
+private:
+  FileCache();
+  // the verified file a url is stored as, empty if it isn't cached
+  std::string lookup(const std::string &key);
+  std::string download(const std::string &url, const std::string &key, size_t chunk_size, int retries, std::atomic<bool> *abort);
+  bool verify(const std::string &path);
+  // removes the least recently used files but keep until the cache fits
+  void evict(const std::string &keep);
+
+  size_t max_size_;
+  std::mutex lock_;
+  std::set<std::string> verified_;
+};
+
+// ends with a '/'
+const std::string &cacheDirectory();
+// the prefix of the files that index url in the cache
 std::string cacheFilePath(const std::string &url);
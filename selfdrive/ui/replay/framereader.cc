@@ -1,12 +1,23 @@
 #include "selfdrive/ui/replay/framereader.h"
 
+#include <algorithm>
 #include <cassert>
+#include <climits>
+#include <cmath>
 #include "libyuv.h"
 
 #include "cereal/visionipc/visionbuf.h"
+#include "selfdrive/common/timing.h"
 
 namespace {
 
+// keep this much playback time decoded ahead, in frames
+const double DECODE_AHEAD_MS = 250;
+const int MIN_DECODE_AHEAD = 2;
+const int MAX_DECODE_AHEAD = 30;
+// larger jumps are seeks and don't count towards the playback speed
+const int MAX_PLAYBACK_STEP = 4;
+
 struct buffer_data {
   const uint8_t *data;
   int64_t offset;
@@ -37,9 +48,19 @@ enum AVPixelFormat get_hw_format(AVCodecContext *ctx, const enum AVPixelFormat *
 
 }  // namespace
 
-FrameReader::FrameReader() {}
+FrameReader::FrameReader() : decode_ahead_(MIN_DECODE_AHEAD) {}
 
 FrameReader::~FrameReader() {
+  if (decode_thread_.joinable()) {
+    {
+      std::lock_guard lk(request_lock_);
+      exit_ = true;
+    }
+    request_cv_.notify_one();
+    decode_thread_.join();
+  }
+  cache_.remove(this);
+
   for (AVPacket *pkt : packets) {
     av_packet_free(&pkt);
   }
@@ -56,10 +77,10 @@ FrameReader::~FrameReader() {
 
 bool FrameReader::load(const std::string &url, bool no_cuda, std::atomic<bool> *abort, bool local_cache, int chunk_size, int retries) {
   FileReader f(local_cache, chunk_size, retries);
-  std::string data = f.read(url, abort);
+  FileData data = f.map(url, abort);
   if (data.empty()) return false;
 
-  return load((std::byte *)data.data(), data.size(), no_cuda, abort);
+  return load(data.data(), data.size(), no_cuda, abort);
 }
 
 bool FrameReader::load(const std::byte *data, size_t size, bool no_cuda, std::atomic<bool> *abort) {
@@ -106,10 +127,13 @@ bool FrameReader::load(const std::byte *data, size_t size, bool no_cuda, std::at
   if (has_cuda_device && !no_cuda) {
     if (!initHardwareDecoder(AV_HWDEVICE_TYPE_CUDA)) {
       printf("No CUDA capable device was found. fallback to CPU decoding.\n");
-    } else {
-      nv12toyuv_buffer.resize(getYUVSize());
     }
   }
+  if (hw_pix_fmt == AV_PIX_FMT_NONE) {
+    // software decoding uses a thread per core, across frames and within a frame
+    decoder_ctx->thread_count = 0;
+    decoder_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+  }
 
   ret = avcodec_open2(decoder_ctx, decoder, nullptr);
   if (ret < 0) return false;
@@ -123,11 +147,16 @@ bool FrameReader::load(const std::byte *data, size_t size, bool no_cuda, std::at
       valid_ = (ret == AVERROR_EOF);
       break;
     }
+    pkt->pts = packets.size();
     packets.push_back(pkt);
+    packets_size_ += pkt->size;
     // some stream seems to contian no keyframes
     key_frames_count_ += pkt->flags & AV_PKT_FLAG_KEY;
   }
   valid_ = valid_ && !packets.empty();
+  if (valid_) {
+    decode_thread_ = std::thread(&FrameReader::decodeAheadThread, this);
+  }
   return valid_;
 }
 
@@ -161,16 +190,31 @@ bool FrameReader::initHardwareDecoder(AVHWDeviceType hw_device_type) {
 
 bool FrameReader::get(int idx, uint8_t *rgb, uint8_t *yuv) {
   assert(rgb || yuv);
+  FrameCache::Frame frame = getYUV(idx);
+  return frame && copyBuffers(*frame, rgb, yuv);
+}
+
+FrameCache::Frame FrameReader::getYUV(int idx) {
   if (!valid_ || idx < 0 || idx >= packets.size()) {
-    return false;
+    return nullptr;
   }
-  return decode(idx, rgb, yuv);
+
+  updateRequest(idx);
+  FrameCache::Frame frame = cache_.get(this, idx);
+  if (!frame) {
+    std::lock_guard lk(decoder_lock_);
+    frame = decode(idx);
+  }
+  return frame;
 }
 
-bool FrameReader::decode(int idx, uint8_t *rgb, uint8_t *yuv) {
+FrameCache::Frame FrameReader::decode(int idx) {
+  // the decode-ahead thread may have got here first
+  if (auto frame = cache_.get(this, idx)) return frame;
+
   int from_idx = idx;
-  if (idx != prev_idx + 1 && key_frames_count_ > 1) {
-    // seeking to the nearest key frame
+  if (key_frames_count_ > 1) {
+    // the nearest key frame
     for (int i = idx; i >= 0; --i) {
       if (packets[i]->flags & AV_PKT_FLAG_KEY) {
         from_idx = i;
@@ -178,29 +222,97 @@ bool FrameReader::decode(int idx, uint8_t *rgb, uint8_t *yuv) {
       }
     }
   }
-  prev_idx = idx;
+  // keep feeding the decoder if it is already on its way to idx, otherwise seek to the key frame
+  if (idx <= last_frame_ || from_idx > next_packet_) {
+    avcodec_flush_buffers(decoder_ctx);
+    next_packet_ = from_idx;
+    last_frame_ = from_idx - 1;
+  }
 
-  for (int i = from_idx; i <= idx; ++i) {
-    AVFrame *f = decodeFrame(packets[i]);
-    if (f && i == idx) {
-      return copyBuffers(f, rgb, yuv);
+  // frames decoded on the way are cached too, so stepping backwards doesn't decode the GOP again.
+  // with frame threading, frames come out a few packets after they went in.
+  FrameCache::Frame frame;
+  bool eof = false;
+  while (last_frame_ < idx && !eof) {
+    AVPacket *pkt = next_packet_ < packets.size() ? packets[next_packet_++] : nullptr;
+    if (avcodec_send_packet(decoder_ctx, pkt) < 0) {
+      printf("Error sending a packet for decoding\n");
+    }
+    // a null packet drains the decoder
+    eof = !pkt;
+    while (AVFrame *f = receiveFrame()) {
+      if (last_frame_ == idx) {
+        frame = toI420(f);
+      } else if (!cache_.contains(this, last_frame_)) {
+        cache_.put(this, last_frame_, toI420(f));
+      }
     }
   }
-  return false;
+  if (eof) {
+    // the decoder has to be flushed before it takes packets again
+    last_frame_ = INT_MAX;
+  }
+  if (frame) {
+    cache_.put(this, idx, frame);
+  }
+  return frame;
 }
 
-AVFrame *FrameReader::decodeFrame(AVPacket *pkt) {
-  int ret = avcodec_send_packet(decoder_ctx, pkt);
-  if (ret < 0) {
-    printf("Error sending a packet for decoding\n");
-    return nullptr;
+void FrameReader::updateRequest(int idx) {
+  const double ts = millis_since_boot();
+  {
+    std::lock_guard lk(request_lock_);
+    const int step = idx - request_idx_;
+    if (request_idx_ >= 0 && step != 0) {
+      request_dir_ = step > 0 ? 1 : -1;
+      if (std::abs(step) <= MAX_PLAYBACK_STEP) {
+        const double interval = (ts - request_ts_) / std::abs(step);
+        frame_interval_ = frame_interval_ > 0 ? frame_interval_ * 0.8 + interval * 0.2 : interval;
+        decode_ahead_ = std::clamp((int)std::ceil(DECODE_AHEAD_MS / std::max(frame_interval_, 1.0)), MIN_DECODE_AHEAD, MAX_DECODE_AHEAD);
+      }
+    }
+    request_idx_ = idx;
+    request_ts_ = ts;
+    request_pending_ = true;
+  }
+  request_cv_.notify_one();
+}
+
+void FrameReader::decodeAheadThread() {
+  while (true) {
+    int idx, dir, ahead;
+    {
+      std::unique_lock lk(request_lock_);
+      request_cv_.wait(lk, [this] { return exit_ || request_pending_; });
+      if (exit_) break;
+
+      request_pending_ = false;
+      idx = request_idx_;
+      dir = request_dir_;
+      ahead = decode_ahead_;
+    }
+
+    // start over as soon as a new frame is requested
+    for (int i = 1; i <= ahead && !exit_ && !request_pending_; ++i) {
+      const int target = idx + dir * i;
+      if (target < 0 || target >= packets.size()) break;
+
+      if (!cache_.contains(this, target)) {
+        std::lock_guard lk(decoder_lock_);
+        decode(target);
+      }
+    }
   }
+}
 
+AVFrame *FrameReader::receiveFrame() {
   av_frame_.reset(av_frame_alloc());
-  ret = avcodec_receive_frame(decoder_ctx, av_frame_.get());
+  int ret = avcodec_receive_frame(decoder_ctx, av_frame_.get());
   if (ret != 0) {
     return nullptr;
   }
+  // packets are numbered through pts in load()
+  last_frame_ = av_frame_->pts != AV_NOPTS_VALUE ? av_frame_->pts : last_frame_ + 1;
 
   if (av_frame_->format == hw_pix_fmt) {
     hw_frame.reset(av_frame_alloc());
@@ -214,29 +326,79 @@ AVFrame *FrameReader::decodeFrame(AVPacket *pkt) {
   }
 }
 
-bool FrameReader::copyBuffers(AVFrame *f, uint8_t *rgb, uint8_t *yuv) {
+FrameCache::Frame FrameReader::toI420(AVFrame *f) {
+  auto frame = std::make_shared<std::vector<uint8_t>>(getYUVSize());
+  uint8_t *y = frame->data();
+  uint8_t *u = y + width * height;
+  uint8_t *v = u + (width / 2) * (height / 2);
   if (hw_pix_fmt == AV_PIX_FMT_CUDA) {
-    uint8_t *y = yuv ? yuv : nv12toyuv_buffer.data();
-    uint8_t *u = y + width * height;
-    uint8_t *v = u + (width / 2) * (height / 2);
     libyuv::NV12ToI420(f->data[0], f->linesize[0], f->data[1], f->linesize[1],
                        y, width, u, width / 2, v, width / 2, width, height);
-    libyuv::I420ToRGB24(y, width, u, width / 2, v, width / 2,
-                        rgb, aligned_width * 3, width, height);
   } else {
-    if (yuv) {
-      uint8_t *u = yuv + width * height;
-      uint8_t *v = u + (width / 2) * (height / 2);
-      libyuv::I420Copy(f->data[0], f->linesize[0],
-                       f->data[1], f->linesize[1],
-                       f->data[2], f->linesize[2],
-                       yuv, width, u, width / 2, v, width / 2,
-                       width, height);
-    }
-    libyuv::I420ToRGB24(f->data[0], f->linesize[0],
-                        f->data[1], f->linesize[1],
-                        f->data[2], f->linesize[2],
+    libyuv::I420Copy(f->data[0], f->linesize[0],
+                     f->data[1], f->linesize[1],
+                     f->data[2], f->linesize[2],
+                     y, width, u, width / 2, v, width / 2,
+                     width, height);
+  }
+  return frame;
+}
+
+bool FrameReader::copyBuffers(const std::vector<uint8_t> &frame, uint8_t *rgb, uint8_t *yuv) {
+  const uint8_t *y = frame.data();
+  const uint8_t *u = y + width * height;
+  const uint8_t *v = u + (width / 2) * (height / 2);
+  if (yuv) {
+    memcpy(yuv, y, frame.size());
+  }
+  if (rgb) {
+    libyuv::I420ToRGB24(y, width, u, width / 2, v, width / 2,
                         rgb, aligned_width * 3, width, height);
   }
   return true;
 }
+
+// class FrameCache
+
+FrameCache::Frame FrameCache::get(const FrameReader *fr, int idx) {
+  std::lock_guard lk(mutex_);
+  auto it = frames_.find({fr, idx});
+  if (it == frames_.end()) return nullptr;
+
+  lru_.splice(lru_.begin(), lru_, it->second.second);
+  return it->second.first;
+}
+
+bool FrameCache::contains(const FrameReader *fr, int idx) {
+  std::lock_guard lk(mutex_);
+  return frames_.find({fr, idx}) != frames_.end();
+}
+
+void FrameCache::put(const FrameReader *fr, int idx, const Frame &frame) {
+  std::lock_guard lk(mutex_);
+  auto [it, inserted] = frames_.try_emplace({fr, idx});
+  if (!inserted) {
+    size_ -= it->second.first->size();
+    lru_.erase(it->second.second);
+  }
+  lru_.push_front({fr, idx});
+  it->second = {frame, lru_.begin()};
+  size_ += frame->size();
+
+  while (size_ > capacity_ && lru_.size() > 1) {
+    auto last = frames_.find(lru_.back());
+    size_ -= last->second.first->size();
+    frames_.erase(last);
+    lru_.pop_back();
+  }
+}
+
+void FrameCache::remove(const FrameReader *fr) {
+  std::lock_guard lk(mutex_);
+  auto it = frames_.lower_bound({fr, INT_MIN});
+  while (it != frames_.end() && it->first.first == fr) {
+    size_ -= it->second.first->size();
+    lru_.erase(it->second.second);
+    it = frames_.erase(it);
+  }
+}
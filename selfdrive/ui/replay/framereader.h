@@ -1,7 +1,13 @@
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "selfdrive/ui/replay/filereader.h"
@@ -15,16 +21,45 @@ struct AVFrameDeleter {
   void operator()(AVFrame* frame) const { av_frame_free(&frame); }
 };
 
+const size_t DEFAULT_FRAME_CACHE_SIZE = 256 * 1024 * 1024;
+
+class FrameReader;
+
+// LRU of decoded I420 frames shared by all FrameReaders, bounded by bytes.
+class FrameCache {
+public:
+  using Frame = std::shared_ptr<const std::vector<uint8_t>>;
+
+  FrameCache(size_t capacity = DEFAULT_FRAME_CACHE_SIZE) : capacity_(capacity) {}
+  Frame get(const FrameReader *fr, int idx);
+  bool contains(const FrameReader *fr, int idx);
+  void put(const FrameReader *fr, int idx, const Frame &frame);
+  void remove(const FrameReader *fr);
+
+private:
+  using Key = std::pair<const FrameReader *, int>;
+  std::mutex mutex_;
+  size_t capacity_, size_ = 0;
+  std::list<Key> lru_;  // most recently used first
+  std::map<Key, std::pair<Frame, std::list<Key>::iterator>> frames_;
+};
+
 class FrameReader {
 public:
   FrameReader();
   ~FrameReader();
   bool load(const std::string &url, bool no_cuda = false, std::atomic<bool> *abort = nullptr, bool local_cache = false, int chunk_size = -1, int retries = 0);
   bool load(const std::byte *data, size_t size, bool no_cuda = false, std::atomic<bool> *abort = nullptr);
+  // rgb or yuv may be null. rgb is converted from yuv only when it is asked for.
   bool get(int idx, uint8_t *rgb, uint8_t *yuv);
+  // the decoded I420 frame as it is cached, without copying or conversion. nullptr on failure.
+  FrameCache::Frame getYUV(int idx);
   int getRGBSize() const { return aligned_width * aligned_height * 3; }
   int getYUVSize() const { return width * height * 3 / 2; }
   size_t getFrameCount() const { return packets.size(); }
+  bool isKeyFrame(int idx) const { return idx >= 0 && idx < packets.size() && (packets[idx]->flags & AV_PKT_FLAG_KEY); }
+  // bytes held by the compressed packets. decoded frames are accounted in the shared cache.
+  size_t memoryUsage() const { return packets_size_; }
   bool valid() const { return valid_; }
 
   int width = 0, height = 0;
@@ -32,21 +67,39 @@ public:
 
 private:
   bool initHardwareDecoder(AVHWDeviceType hw_device_type);
-  bool decode(int idx, uint8_t *rgb, uint8_t *yuv);
-  AVFrame * decodeFrame(AVPacket *pkt);
-  bool copyBuffers(AVFrame *f, uint8_t *rgb, uint8_t *yuv);
+  // decodes idx and every frame before it back to the nearest key frame into the cache.
+  // must be called with decoder_lock_ held.
+  FrameCache::Frame decode(int idx);
+  // next frame out of the decoder, nullptr if it needs more packets
+  AVFrame * receiveFrame();
+  FrameCache::Frame toI420(AVFrame *f);
+  bool copyBuffers(const std::vector<uint8_t> &frame, uint8_t *rgb, uint8_t *yuv);
+  void updateRequest(int idx);
+  void decodeAheadThread();
 
   std::vector<AVPacket*> packets;
   std::unique_ptr<AVFrame, AVFrameDeleter>av_frame_, hw_frame;
   AVFormatContext *input_ctx = nullptr;
   AVCodecContext *decoder_ctx = nullptr;
   int key_frames_count_ = 0;
+  size_t packets_size_ = 0;
   bool valid_ = false;
   AVIOContext *avio_ctx_ = nullptr;
 
   AVPixelFormat hw_pix_fmt = AV_PIX_FMT_NONE;
   AVBufferRef *hw_device_ctx = nullptr;
-  std::vector<uint8_t> nv12toyuv_buffer;
-  int prev_idx = -1;
+  int next_packet_ = 0, last_frame_ = -1;
+  std::mutex decoder_lock_;
+
+  // the decode-ahead thread keeps the next frames in the playback direction cached.
+  // how far ahead follows the rate get() is called at.
+  std::thread decode_thread_;
+  std::mutex request_lock_;
+  std::condition_variable request_cv_;
+  std::atomic<bool> exit_ = false, request_pending_ = false;
+  int request_idx_ = -1, request_dir_ = 1, decode_ahead_;
+  double request_ts_ = 0, frame_interval_ = 0;
+
   inline static std::atomic<bool> has_cuda_device = true;
+  inline static FrameCache cache_;
 };
@@ -0,0 +1,284 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDir>
+#include <QFileInfo>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <thread>
+
+#include <capnp/dynamic.h>
+#include <capnp/schema.h>
+
+#include "selfdrive/common/util.h"
+#include "selfdrive/ui/replay/logreader.h"
+#include "selfdrive/ui/replay/route.h"
+#include "selfdrive/ui/replay/util.h"
+
+// exports fields of rlogs into one table per service, with a column per field plus logMonoTime.
+// columns are written as .npy files: <out>/<segment>/<service>/<field>.npy, which numpy and
+// pandas load directly (np.load(..., mmap_mode='r')).
+
+namespace {
+
+struct Column {
+  std::string name;
+  // path from the service struct down to the field
+  std::vector<capnp::StructSchema::Field> path;
+  capnp::schema::Type::Which type;
+  const char *dtype;
+  size_t size;
+};
+
+struct Table {
+  std::string service;
+  capnp::StructSchema::Field field;
+  cereal::Event::Which which;
+  std::vector<Column> columns;
+};
+
+bool primitiveType(capnp::schema::Type::Which type, const char **dtype, size_t *size) {
+  static const std::map<capnp::schema::Type::Which, std::pair<const char *, size_t>> types = {
+      {capnp::schema::Type::BOOL, {"|b1", 1}},
+      {capnp::schema::Type::INT8, {"|i1", 1}},
+      {capnp::schema::Type::INT16, {"<i2", 2}},
+      {capnp::schema::Type::INT32, {"<i4", 4}},
+      {capnp::schema::Type::INT64, {"<i8", 8}},
+      {capnp::schema::Type::UINT8, {"|u1", 1}},
+      {capnp::schema::Type::UINT16, {"<u2", 2}},
+      {capnp::schema::Type::UINT32, {"<u4", 4}},
+      {capnp::schema::Type::UINT64, {"<u8", 8}},
+      {capnp::schema::Type::FLOAT32, {"<f4", 4}},
+      {capnp::schema::Type::FLOAT64, {"<f8", 8}},
+      // enums are exported as their raw value
+      {capnp::schema::Type::ENUM, {"<u2", 2}},
+  };
+  auto it = types.find(type);
+  if (it == types.end()) return false;
+  std::tie(*dtype, *size) = it->second;
+  return true;
+}
+
+// resolve "service.field[.field...]" against the Event schema. fields of a service share a table.
+bool addField(std::vector<Table> &tables, const std::string &path) {
+  std::vector<std::string> parts;
+  for (const QString &part : QString::fromStdString(path).split(".")) {
+    parts.push_back(part.toStdString());
+  }
+  if (parts.size() < 2) {
+    std::cerr << "invalid field " << path << ", expected service.field" << std::endl;
+    return false;
+  }
+
+  auto event_schema = capnp::Schema::from<cereal::Event>();
+  KJ_IF_MAYBE(field, event_schema.findFieldByName(parts[0])) {
+    if (field->getProto().getDiscriminantValue() == capnp::schema::Field::NO_DISCRIMINANT ||
+        !field->getType().isStruct()) {
+      std::cerr << parts[0] << " is not a service" << std::endl;
+      return false;
+    }
+    auto table = std::find_if(tables.begin(), tables.end(), [&](auto &t) { return t.service == parts[0]; });
+    if (table == tables.end()) {
+      const auto which = (cereal::Event::Which)field->getProto().getDiscriminantValue();
+      table = tables.insert(tables.end(), {parts[0], *field, which, {}});
+    }
+
+    Column col = {.name = path.substr(parts[0].size() + 1)};
+    capnp::Type type = field->getType();
+    for (int i = 1; i < parts.size(); ++i) {
+      if (!type.isStruct()) {
+        std::cerr << "can't export " << path << ", " << parts[i - 1] << " is not a struct" << std::endl;
+        return false;
+      }
+      KJ_IF_MAYBE(f, type.asStruct().findFieldByName(parts[i])) {
+        col.path.push_back(*f);
+        type = f->getType();
+      } else {
+        std::cerr << "no field " << parts[i] << " in " << path << std::endl;
+        return false;
+      }
+    }
+    col.type = type.which();
+    if (!primitiveType(col.type, &col.dtype, &col.size)) {
+      std::cerr << "can't export " << path << ", only numbers, bools and enums are supported" << std::endl;
+      return false;
+    }
+    table->columns.push_back(col);
+    return true;
+  }
+  std::cerr << "unknown service " << parts[0] << std::endl;
+  return false;
+}
+
+void appendValue(std::string &buf, const Column &col, const capnp::DynamicValue::Reader &v) {
+  auto append = [&](auto value) { buf.append((const char *)&value, sizeof(value)); };
+  switch (col.type) {
+    case capnp::schema::Type::BOOL: append(v.as<bool>()); break;
+    case capnp::schema::Type::INT8: append(v.as<int8_t>()); break;
+    case capnp::schema::Type::INT16: append(v.as<int16_t>()); break;
+    case capnp::schema::Type::INT32: append(v.as<int32_t>()); break;
+    case capnp::schema::Type::INT64: append(v.as<int64_t>()); break;
+    case capnp::schema::Type::UINT8: append(v.as<uint8_t>()); break;
+    case capnp::schema::Type::UINT16: append(v.as<uint16_t>()); break;
+    case capnp::schema::Type::UINT32: append(v.as<uint32_t>()); break;
+    case capnp::schema::Type::UINT64: append(v.as<uint64_t>()); break;
+    case capnp::schema::Type::FLOAT32: append(v.as<float>()); break;
+    case capnp::schema::Type::FLOAT64: append(v.as<double>()); break;
+    case capnp::schema::Type::ENUM: append(v.as<capnp::DynamicEnum>().getRaw()); break;
+    default: assert(0);
+  }
+}
+
+// a union member can only be read while it is the one that is set
+bool isSet(const capnp::DynamicStruct::Reader &s, const capnp::StructSchema::Field &field) {
+  if (field.getProto().getDiscriminantValue() == capnp::schema::Field::NO_DISCRIMINANT) return true;
+  auto which = s.which();
+  KJ_IF_MAYBE(active, which) {
+    return *active == field;
+  }
+  return false;
+}
+
+// rows whose field is in an unset union member are NaN, or 0 for other types
+void appendMissing(std::string &buf, const Column &col) {
+  if (col.type == capnp::schema::Type::FLOAT32) {
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    buf.append((const char *)&nan, sizeof(nan));
+  } else if (col.type == capnp::schema::Type::FLOAT64) {
+    const double nan = std::numeric_limits<double>::quiet_NaN();
+    buf.append((const char *)&nan, sizeof(nan));
+  } else {
+    buf.append(col.size, '\0');
+  }
+}
+
+bool exportSegment(const std::string &log_file, const std::string &out_dir, const std::vector<Table> &tables) {
+  LogReader log;
+  if (!log.load(log_file)) {
+    std::cerr << "failed to read " << log_file << std::endl;
+    return false;
+  }
+  const bool has_can = std::any_of(tables.begin(), tables.end(), [](auto &t) {
+    return t.which == cereal::Event::CAN || t.which == cereal::Event::SENDCAN;
+  });
+  if (auto can_log = canLogPath(log_file); has_can && !can_log.empty() && !log.loadCanLog(can_log)) {
+    std::cerr << "failed to read " << can_log << std::endl;
+    return false;
+  }
+
+  std::map<cereal::Event::Which, const Table *> by_which;
+  for (auto &t : tables) {
+    by_which[t.which] = &t;
+  }
+  // columns of each table, logMonoTime first
+  std::map<const Table *, std::vector<std::string>> data;
+  for (auto &t : tables) {
+    data[&t].resize(t.columns.size() + 1);
+  }
+
+  for (const Event *e : log.events) {
+    auto it = by_which.find(e->which);
+    if (e->frame || it == by_which.end()) continue;
+
+    const Table *t = it->second;
+    auto &columns = data[t];
+    columns[0].append((const char *)&e->mono_time, sizeof(e->mono_time));
+    auto service = capnp::toDynamic(e->event).get(t->field).as<capnp::DynamicStruct>();
+    for (int i = 0; i < t->columns.size(); ++i) {
+      const Column &col = t->columns[i];
+      capnp::DynamicStruct::Reader s = service;
+      size_t j = 0;
+      for (; j < col.path.size() && isSet(s, col.path[j]); ++j) {
+        if (j + 1 < col.path.size()) s = s.get(col.path[j]).as<capnp::DynamicStruct>();
+      }
+      if (j == col.path.size()) {
+        appendValue(columns[i + 1], col, s.get(col.path.back()));
+      } else {
+        appendMissing(columns[i + 1], col);
+      }
+    }
+  }
+
+  bool ok = true;
+  for (auto &t : tables) {
+    const std::string dir = out_dir + "/" + t.service;
+    if (!util::create_directories(dir, 0755)) {
+      std::cerr << "failed to create " << dir << std::endl;
+      return false;
+    }
+    const auto &columns = data[&t];
+    const size_t count = columns[0].size() / sizeof(uint64_t);
+    ok &= writeNpy(dir + "/logMonoTime.npy", "<u8", count, columns[0]);
+    for (int i = 0; i < t.columns.size(); ++i) {
+      ok &= writeNpy(dir + "/" + t.columns[i].name + ".npy", t.columns[i].dtype, count, columns[i + 1]);
+    }
+  }
+  return ok;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  QCoreApplication app(argc, argv);
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription("Export fields of rlogs into per-service columnar .npy tables.");
+  parser.addHelpOption();
+  parser.addPositionalArgument("logs", "rlog/qlog files, or a route with --data_dir", "logs...");
+  parser.addOption({"data_dir", "local directory with the route", "data_dir"});
+  parser.addOption({{"f", "fields"}, "fields to export, e.g. carState.vEgo,controlsState.enabled", "fields"});
+  parser.addOption({{"o", "out"}, "output directory", "out"});
+  parser.addOption({{"j", "jobs"}, "segments exported at once", "jobs", QString::number(std::thread::hardware_concurrency())});
+  parser.process(app);
+
+  const QStringList args = parser.positionalArguments();
+  if (args.empty() || parser.value("fields").isEmpty() || parser.value("out").isEmpty()) {
+    parser.showHelp(1);
+  }
+
+  std::vector<Table> tables;
+  for (const QString &field : parser.value("fields").split(",")) {
+    if (!addField(tables, field.toStdString())) return 1;
+  }
+
+  // segments are named after the directory of their log
+  std::vector<std::pair<std::string, std::string>> segments;
+  if (!parser.value("data_dir").isEmpty()) {
+    Route route(args.first(), parser.value("data_dir"));
+    if (!route.load()) {
+      std::cerr << "failed to load route " << args.first().toStdString() << std::endl;
+      return 1;
+    }
+    for (const auto &[n, files] : route.segments()) {
+      const QString log = files.rlog.isEmpty() ? files.qlog : files.rlog;
+      if (!log.isEmpty()) {
+        segments.push_back({log.toStdString(), QFileInfo(log).dir().dirName().toStdString()});
+      }
+    }
+  } else {
+    for (const QString &log : args) {
+      if (log.startsWith("http://") || log.startsWith("https://")) {
+        std::cerr << "only local logs can be exported: " << log.toStdString() << std::endl;
+        return 1;
+      }
+      segments.push_back({log.toStdString(), QFileInfo(log).dir().dirName().toStdString()});
+    }
+  }
+
+  // a segment per thread, each holds one decompressed log at a time
+  const std::string out_dir = parser.value("out").toStdString();
+  std::atomic<int> failed = 0;
+  std::mutex print_lock;
+  parallelFor(segments.size(), parser.value("jobs").toInt(), [&](int n) {
+    const auto &[log, name] = segments[n];
+    bool ok = exportSegment(log, out_dir + "/" + name, tables);
+    failed += !ok;
+    std::lock_guard lk(print_lock);
+    std::cout << (ok ? "exported " : "failed to export ") << log << std::endl;
+  });
+  return failed > 0;
+}
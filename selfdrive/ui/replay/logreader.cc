@@ -1,9 +1,50 @@
 #include "selfdrive/ui/replay/logreader.h"
 
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <cstring>
 #include <iostream>
+
+#include <capnp/serialize.h>
+
+#include "selfdrive/common/util.h"
+#include "selfdrive/loggerd/can_codec.h"
 #include "selfdrive/ui/replay/util.h"
 
+namespace {
+
+class MmapDisposer : public kj::ArrayDisposer {
+protected:
+  void disposeImpl(void *firstElement, size_t elementSize, size_t elementCount, size_t capacity,
+                   void (*destroyElement)(void *)) const override {
+    munmap(firstElement, elementSize * capacity);
+  }
+};
+const MmapDisposer mmap_disposer;
+
+// a block backed by an unlinked temp file instead of anonymous memory. under memory pressure
+// the kernel writes it back to the file and drops it rather than swapping.
+kj::Array<capnp::word> mmapBlock(size_t words) {
+  std::string path = cacheDirectory() + "log_XXXXXX";
+  int fd = mkstemp(path.data());
+  if (fd < 0) {
+    return kj::heapArray<capnp::word>(words);
+  }
+  unlink(path.c_str());
+
+  const size_t size = words * sizeof(capnp::word);
+  void *addr = ftruncate(fd, size) == 0 ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (addr == MAP_FAILED) {
+    return kj::heapArray<capnp::word>(words);
+  }
+  return kj::Array<capnp::word>((capnp::word *)addr, words, mmap_disposer);
+}
+
+}  // namespace
+
 Event::Event(const kj::ArrayPtr<const capnp::word> &amsg, bool frame) : reader(amsg), frame(frame) {
   words = kj::ArrayPtr<const capnp::word>(amsg.begin(), reader.getEnd());
   event = reader.getRoot<cereal::Event>();
@@ -27,7 +68,7 @@ Event::Event(const kj::ArrayPtr<const capnp::word> &amsg, bool frame) : reader(a
 
 // class LogReader
 
-LogReader::LogReader(size_t memory_pool_block_size) {
+LogReader::LogReader(size_t memory_pool_block_size, bool spill_to_disk) : spill_to_disk_(spill_to_disk) {
 #ifdef HAS_MEMORY_RESOURCE
   const size_t buf_size = sizeof(Event) * memory_pool_block_size;
   pool_buffer_ = ::operator new(buf_size);
@@ -40,6 +81,9 @@ LogReader::~LogReader() {
   for (Event *e : events) {
     delete e;
   }
+  for (Event *e : frame_events_) {
+    delete e;
+  }
 
 #ifdef HAS_MEMORY_RESOURCE
   delete mbr_;
@@ -49,22 +93,146 @@ LogReader::~LogReader() {
 
 bool LogReader::load(const std::string &url, std::atomic<bool> *abort, bool local_cache, int chunk_size, int retries) {
   FileReader f(local_cache, chunk_size, retries);
-  std::string data = f.read(url, abort);
+  FileData data = f.map(url, abort);
   if (data.empty()) return false;
 
-  return load((std::byte*)data.data(), data.size(), abort);
+  return load(data.data(), data.size(), abort);
 }
 
 bool LogReader::load(const std::byte *data, size_t size, std::atomic<bool> *abort) {
-  raw_ = decompressBZ2(data, size);
-  if (raw_.empty()) {
-    std::cout << "failed to decompress log" << std::endl;
+  if (size == 0) return false;
+
+  const size_t sorted_until = events.size();
+  // bz2 blocks are decompressed in parallel and handed over in order. copy them into word-aligned
+  // blocks and parse every event as soon as it is complete. events point into the blocks, so a
+  // block is never reallocated; a message that straddles the end of a block is moved to the next one.
+  const size_t first_block_words = std::max<size_t>(size * 3, 1 << 20) / sizeof(capnp::word);
+  const size_t block_words = (8 << 20) / sizeof(capnp::word);
+  size_t parsed = 0;     // in words, within the last block
+  size_t out_bytes = 0;  // bytes copied into the last block, may end mid-word
+  bool corrupt = false;
+  blocks_.push_back(allocBlock(first_block_words));
+
+  bool ok = decompressBZ2(data, size, [&](const char *out, size_t len) {
+    while (len > 0 && !corrupt) {
+      auto *block = &blocks_.back();
+      if (out_bytes == block->size() * sizeof(capnp::word)) {
+        const size_t pending = block->size() - parsed;
+        auto next = allocBlock(std::max(block_words, pending * 2));
+        memcpy(next.begin(), block->begin() + parsed, pending * sizeof(capnp::word));
+        blocks_.push_back(std::move(next));
+        block = &blocks_.back();
+        out_bytes = pending * sizeof(capnp::word);
+        parsed = 0;
+      }
+
+      const size_t n = std::min(len, block->size() * sizeof(capnp::word) - out_bytes);
+      memcpy((char *)block->begin() + out_bytes, out, n);
+      out_bytes += n;
+      out += n;
+      len -= n;
+
+      const size_t used = out_bytes / sizeof(capnp::word);
+      parsed += parseEvents(kj::arrayPtr(block->begin() + parsed, block->begin() + used), corrupt);
+    }
+    return !corrupt && !(abort && *abort);
+  });
+
+  if (!ok || corrupt || parsed * sizeof(capnp::word) != out_bytes) {
+    if (events.empty()) {
+      std::cout << "failed to decompress log" << std::endl;
+      return false;
+    }
+    std::cout << "read " << events.size() << " events from corrupt log" << std::endl;
+  }
+
+  sortEvents(sorted_until);
+  return !(abort && *abort);
+}
+
+kj::Array<capnp::word> LogReader::allocBlock(size_t words) {
+  return spill_to_disk_ ? mmapBlock(words) : kj::heapArray<capnp::word>(words);
+}
+
+size_t LogReader::memoryUsage() const {
+  size_t bytes = events.capacity() * sizeof(Event *) + events.size() * sizeof(Event);
+  for (const auto &block : blocks_) {
+    bytes += block.size() * sizeof(capnp::word);
+  }
+  return bytes;
+}
+
+std::string canLogPath(const std::string &log_file) {
+  const std::string rlog = "rlog.bz2";
+  if (log_file.size() < rlog.size() || log_file.compare(log_file.size() - rlog.size(), rlog.size(), rlog) != 0) return "";
+
+  std::string can_log = log_file.substr(0, log_file.size() - rlog.size()) + "rcan.bz2";
+  return util::file_exists(can_log) ? can_log : "";
+}
+
+bool LogReader::loadCanLog(const std::string &url, std::atomic<bool> *abort, bool local_cache, int chunk_size, int retries) {
+  FileReader f(local_cache, chunk_size, retries);
+  std::string data = f.read(url, abort);
+  if (data.empty()) return false;
+
+  return loadCanLog((const std::byte *)data.data(), data.size());
+}
+
+bool LogReader::loadCanLog(const std::byte *data, size_t size) {
+  std::string columns = decompressBZ2(data, size);
+  if (columns.empty()) {
+    std::cout << "failed to decompress can log" << std::endl;
     return false;
   }
+  std::string raw;
+  if (!can_log_decode(columns, raw)) {
+    std::cout << "can log is corrupt, read " << raw.size() << " bytes of events" << std::endl;
+  }
+  if (raw.empty()) return true;
+
+  // events point into the block, so every call gets its own
+  auto block = allocBlock(raw.size() / sizeof(capnp::word));
+  memcpy(block.begin(), raw.data(), block.size() * sizeof(capnp::word));
+  blocks_.push_back(std::move(block));
+  return parse(blocks_.back().asPtr());
+}
+
+bool LogReader::parse(kj::ArrayPtr<const capnp::word> words) {
+  const size_t sorted_until = events.size();
+  bool corrupt = false;
+  size_t consumed = parseEvents(words, corrupt);
+  if (corrupt || consumed != words.size()) {
+    if (events.empty()) return false;
+    std::cout << "read " << events.size() << " events from corrupt log" << std::endl;
+  }
 
+  sortEvents(sorted_until);
+  return true;
+}
+
+void LogReader::sortEvents(size_t sorted_until) {
+  // logs are written in order, so the new events usually only need checking. frame events are
+  // timestamped by sof rather than logMonoTime and are kept in their own run until here.
+  auto sort_if_needed = [](auto begin, auto end) {
+    if (!std::is_sorted(begin, end, Event::lessThan())) {
+      std::sort(begin, end, Event::lessThan());
+    }
+  };
+  sort_if_needed(events.begin() + sorted_until, events.end());
+  sort_if_needed(frame_events_.begin(), frame_events_.end());
+
+  const size_t frames_begin = events.size();
+  events.insert(events.end(), frame_events_.begin(), frame_events_.end());
+  frame_events_.clear();
+  std::inplace_merge(events.begin() + sorted_until, events.begin() + frames_begin, events.end(), Event::lessThan());
+  std::inplace_merge(events.begin(), events.begin() + sorted_until, events.end(), Event::lessThan());
+}
+
+size_t LogReader::parseEvents(kj::ArrayPtr<const capnp::word> words, bool &corrupt) {
+  const capnp::word *begin = words.begin();
   try {
-    kj::ArrayPtr<const capnp::word> words((const capnp::word *)raw_.data(), raw_.size() / sizeof(capnp::word));
-    while (words.size() > 0) {
+    // stop at the first incomplete message, the rest is still being decompressed
+    while (words.size() > 0 && capnp::expectedSizeInWordsFromPrefix(words) <= words.size()) {
 
 #ifdef HAS_MEMORY_RESOURCE
       Event *evt = new (mbr_) Event(words);
@@ -83,7 +251,7 @@ bool LogReader::load(const std::byte *data, size_t size, std::atomic<bool> *abor
         Event *frame_evt = new Event(words, true);
 #endif
 
-        events.push_back(frame_evt);
+        frame_events_.push_back(frame_evt);
       }
 
       words = kj::arrayPtr(evt->reader.getEnd(), words.end());
@@ -91,11 +259,34 @@ bool LogReader::load(const std::byte *data, size_t size, std::atomic<bool> *abor
     }
   } catch (const kj::Exception &e) {
     std::cout << "failed to parse log : " << e.getDescription().cStr() << std::endl;
-    if (events.empty()) return false;
+    corrupt = true;
+  }
+  return words.begin() - begin;
+}
 
-    std::cout << "read " << events.size() << " events from corrupt log" << std::endl;
+// class EventMerger
+
+void EventMerger::reset(const std::vector<const std::vector<Event *> *> &lists, const Event *after) {
+  heap_.clear();
+  for (auto list : lists) {
+    auto it = std::upper_bound(list->begin(), list->end(), after, Event::lessThan());
+    if (it != list->end()) {
+      heap_.push_back({it, list->end()});
+    }
   }
+  std::make_heap(heap_.begin(), heap_.end(), Cursor::greater());
+}
 
-  std::sort(events.begin(), events.end(), Event::lessThan());
-  return true;
+const Event *EventMerger::next() {
+  if (heap_.empty()) return nullptr;
+
+  std::pop_heap(heap_.begin(), heap_.end(), Cursor::greater());
+  Cursor &c = heap_.back();
+  const Event *evt = *c.it;
+  if (++c.it != c.end) {
+    std::push_heap(heap_.begin(), heap_.end(), Cursor::greater());
+  } else {
+    heap_.pop_back();
+  }
+  return evt;
 }
@@ -46,17 +46,54 @@ public:
   bool frame;
 };
 
+// walks several sorted event lists in time order with a k-way heap merge, without copying them.
+class EventMerger {
+public:
+  // position on the first event after `after` in each list
+  void reset(const std::vector<const std::vector<Event *> *> &lists, const Event *after);
+  // returns nullptr when all lists are exhausted
+  const Event *next();
+
+private:
+  struct Cursor {
+    std::vector<Event *>::const_iterator it, end;
+    struct greater {
+      inline bool operator()(const Cursor &l, const Cursor &r) { return Event::lessThan()(*r.it, *l.it); }
+    };
+  };
+  std::vector<Cursor> heap_;
+};
+
+// the rcan.bz2 loggerd writes next to a local rlog with LOGGERD_CAN_CODEC, empty if there is none.
+// can/sendcan are only in that file then.
+std::string canLogPath(const std::string &log_file);
+
 class LogReader {
 public:
-  LogReader(size_t memory_pool_block_size = DEFAULT_EVENT_MEMORY_POOL_BLOCK_SIZE);
+  // with spill_to_disk, decompressed logs live in mmap'd temp files that the kernel can page out
+  LogReader(size_t memory_pool_block_size = DEFAULT_EVENT_MEMORY_POOL_BLOCK_SIZE, bool spill_to_disk = false);
   ~LogReader();
   bool load(const std::string &url, std::atomic<bool> *abort = nullptr, bool local_cache = false, int chunk_size = -1, int retries = 0);
   bool load(const std::byte *data, size_t size, std::atomic<bool> *abort = nullptr);
+  // merge can/sendcan events from a columnar rcan.bz2 written next to the rlog
+  bool loadCanLog(const std::string &url, std::atomic<bool> *abort = nullptr, bool local_cache = false, int chunk_size = -1, int retries = 0);
+  bool loadCanLog(const std::byte *data, size_t size);
+  // bytes held by the decompressed log and its events
+  size_t memoryUsage() const;
 
   std::vector<Event*> events;
 
 private:
-  std::string raw_;
+  bool parse(kj::ArrayPtr<const capnp::word> words);
+  // parse complete messages from words, returns the number of words consumed
+  size_t parseEvents(kj::ArrayPtr<const capnp::word> words, bool &corrupt);
+  // sort events added after sorted_until and merge them with the ones before
+  void sortEvents(size_t sorted_until);
+  kj::Array<capnp::word> allocBlock(size_t words);
+
+  std::vector<Event*> frame_events_;
+  std::vector<kj::Array<capnp::word>> blocks_;
+  bool spill_to_disk_;
 #ifdef HAS_MEMORY_RESOURCE
   std::pmr::monotonic_buffer_resource *mbr_ = nullptr;
   void *pool_buffer_ = nullptr;
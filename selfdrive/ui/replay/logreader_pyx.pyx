@@ -0,0 +1,138 @@
+# distutils: language = c++
+# cython: language_level = 3
+from cpython.buffer cimport PyBuffer_FillInfo
+from libc.stdint cimport uint64_t
+from libcpp cimport bool
+from libcpp.string cimport string
+from libcpp.unordered_set cimport unordered_set
+from libcpp.vector cimport vector
+
+cdef extern from "selfdrive/ui/replay/logreader.h":
+  cdef cppclass ByteArray "kj::ArrayPtr<const capnp::byte>":
+    const unsigned char *begin()
+    size_t size()
+
+  cdef cppclass c_Event "Event":
+    uint64_t mono_time
+    int which
+    bool frame
+    ByteArray bytes()
+
+  cdef cppclass c_LogReader "LogReader":
+    c_LogReader()
+    bool load(string) nogil
+    bool loadCanLog(string) nogil
+    vector[c_Event *] events
+
+  string canLogPath(string)
+
+cdef extern from "selfdrive/loggerd/can_codec.h":
+  bool can_log_decode(const string &, string &) nogil
+
+cdef extern from *:
+  """
+  static bool load_bytes(LogReader *lr, const char *data, size_t size) {
+    return lr->load((const std::byte *)data, size);
+  }
+  static bool load_can_log_bytes(LogReader *lr, const char *data, size_t size) {
+    return lr->loadCanLog((const std::byte *)data, size);
+  }
+  """
+  bool load_bytes(c_LogReader *lr, const char *data, size_t size) nogil
+  bool load_can_log_bytes(c_LogReader *lr, const char *data, size_t size) nogil
+
+
+def can_log_path(fn):
+  """rcan.bz2 next to a local rlog, None if loggerd didn't write one"""
+  path = canLogPath(fn.encode())
+  return path.decode() if path.size() > 0 else None
+
+
+def decode_can_log(bytes columns):
+  """decodes a decompressed rcan.bz2 into serialized can/sendcan events, back to back like an rlog"""
+  cdef string c_columns = columns
+  cdef string out
+  with nogil:
+    can_log_decode(c_columns, out)
+  return out
+
+
+cdef class EventData:
+  # one message in the memory of a LogReader, exposed through the buffer protocol.
+  # pycapnp readers made from it point into the log and keep it alive.
+  cdef object owner
+  cdef const unsigned char *ptr
+  cdef Py_ssize_t size
+
+  def __getbuffer__(self, Py_buffer *buffer, int flags):
+    PyBuffer_FillInfo(buffer, self, <void *>self.ptr, self.size, 1, flags)
+
+  def __releasebuffer__(self, Py_buffer *buffer):
+    pass
+
+
+cdef class LogReader:
+  cdef c_LogReader *lr
+
+  def __cinit__(self):
+    self.lr = new c_LogReader()
+
+  def __dealloc__(self):
+    del self.lr
+
+  def load(self, fn):
+    cdef string path = fn.encode()
+    cdef bool ok
+    with nogil:
+      ok = self.lr.load(path)
+    return ok
+
+  def load_bytes(self, bytes dat):
+    cdef const char *data = dat
+    cdef size_t size = len(dat)
+    cdef bool ok
+    with nogil:
+      ok = load_bytes(self.lr, data, size)
+    return ok
+
+  def load_can_log(self, fn):
+    cdef string path = fn.encode()
+    cdef bool ok
+    with nogil:
+      ok = self.lr.loadCanLog(path)
+    return ok
+
+  def load_can_log_bytes(self, bytes dat):
+    cdef const char *data = dat
+    cdef size_t size = len(dat)
+    cdef bool ok
+    with nogil:
+      ok = load_can_log_bytes(self.lr, data, size)
+    return ok
+
+  def __len__(self):
+    return self.lr.events.size()
+
+  def events(self, which=None):
+    """yields (logMonoTime, which, EventData) in time order. which is an optional
+    collection of union discriminants to keep."""
+    cdef unordered_set[int] keep
+    cdef bool filtered = which is not None
+    if filtered:
+      for w in which:
+        keep.insert(w)
+
+    cdef c_Event *e
+    cdef EventData d
+    cdef size_t i
+    for i in range(self.lr.events.size()):
+      e = self.lr.events[i]
+      # encodeIdx events are listed twice, once more for the video stream
+      if e.frame or (filtered and keep.count(e.which) == 0):
+        continue
+
+      d = EventData.__new__(EventData)
+      d.owner = self
+      d.ptr = e.bytes().begin()
+      d.size = e.bytes().size()
+      yield e.mono_time, e.which, d
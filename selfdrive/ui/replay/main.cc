@@ -103,6 +103,9 @@ int main(int argc, char *argv[]) {
       {"qcam", REPLAY_FLAG_QCAMERA, "load qcamera"},
       {"yuv", REPLAY_FLAG_SEND_YUV, "send yuv frame"},
       {"no-cuda", REPLAY_FLAG_NO_CUDA, "disable CUDA"},
+      {"no-rgb", REPLAY_FLAG_NO_RGB, "send yuv frames only, skipping the rgb conversion"},
+      {"headless", REPLAY_FLAG_HEADLESS, "replay as fast as consumers keep up and quit at the end of the route"},
+      {"spill-logs", REPLAY_FLAG_SPILL_LOGS, "keep decompressed logs in mmap'd temp files the kernel can page out"},
   };
 
   QCommandLineParser parser;
@@ -111,9 +114,11 @@ int main(int argc, char *argv[]) {
   parser.addPositionalArgument("route", "the drive to replay. find your drives at connect.comma.ai");
   parser.addOption({{"a", "allow"}, "whitelist of services to send", "allow"});
   parser.addOption({{"b", "block"}, "blacklist of services to send", "block"});
+  parser.addOption({"ack", "wait for consumers to respond to a service before sending the next message, e.g. can:controlsState", "trigger:response,..."});
   parser.addOption({{"s", "start"}, "start from <seconds>", "seconds"});
   parser.addOption({"demo", "use a demo route instead of providing your own"});
   parser.addOption({"data_dir", "local directory with routes", "data_dir"});
+  parser.addOption({"memory", "memory budget for loaded segments", "MB"});
   for (auto &[name, _, desc] : flags) {
     parser.addOption({name, desc});
   }
@@ -127,6 +132,7 @@ int main(int argc, char *argv[]) {
   const QString route = args.empty() ? DEMO_ROUTE : args.first();
   QStringList allow = parser.value("allow").isEmpty() ? QStringList{} : parser.value("allow").split(",");
   QStringList block = parser.value("block").isEmpty() ? QStringList{} : parser.value("block").split(",");
+  QStringList ack = parser.value("ack").isEmpty() ? QStringList{} : parser.value("ack").split(",");
 
   uint32_t replay_flags = REPLAY_FLAG_NONE;
   for (const auto &[name, flag, _] : flags) {
@@ -134,11 +140,16 @@ int main(int argc, char *argv[]) {
       replay_flags |= flag;
     }
   }
-  replay = new Replay(route, allow, block, nullptr, replay_flags, parser.value("data_dir"), &app);
+  replay = new Replay(route, allow, block, nullptr, replay_flags, parser.value("data_dir"), ack, &app);
+  replay->setMemoryBudget(parser.value("memory").toULongLong() * 1024 * 1024);
   if (!replay->load()) {
     return 0;
   }
   replay->start(parser.value("start").toInt());
+  if (replay_flags & REPLAY_FLAG_HEADLESS) {
+    QObject::connect(replay, &Replay::streamFinished, &app, &QApplication::quit);
+    return app.exec();
+  }
   // start keyboard control thread
   QThread *t = new QThread();
   QObject::connect(t, &QThread::started, [=]() { keyboardThread(replay); });
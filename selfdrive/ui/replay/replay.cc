@@ -10,10 +10,41 @@
 #include "selfdrive/hardware/hw.h"
 #include "selfdrive/ui/replay/util.h"
 
-Replay::Replay(QString route, QStringList allow, QStringList block, SubMaster *sm_, uint32_t flags, QString data_dir, QObject *parent)
+const int ACK_TIMEOUT_MS = 1000;
+
+Replay::Replay(QString route, QStringList allow, QStringList block, SubMaster *sm_, uint32_t flags, QString data_dir,
+               QStringList ack, QObject *parent)
     : sm(sm_), flags_(flags), QObject(parent) {
-  std::vector<const char *> s;
   auto event_struct = capnp::Schema::from<cereal::Event>().asStruct();
+  auto find_service = [](const QString &name) -> const char * {
+    for (const auto &it : services) {
+      if (name == it.name) return it.name;
+    }
+    return nullptr;
+  };
+
+  // "trigger:response" pairs. responses are published by the consumers, not replayed from the log.
+  std::vector<const char *> ack_list;
+  for (const QString &pair : ack) {
+    QStringList names = pair.split(":");
+    const char *trigger = names.size() == 2 ? find_service(names[0]) : nullptr;
+    const char *response = names.size() == 2 ? find_service(names[1]) : nullptr;
+    if (!trigger || !response) {
+      qWarning() << "invalid ack" << pair;
+      continue;
+    }
+    uint16_t which = event_struct.getFieldByName(trigger).getProto().getDiscriminantValue();
+    ack_services_[(cereal::Event::Which)which].push_back(response);
+    if (std::find(ack_list.begin(), ack_list.end(), response) == ack_list.end()) {
+      ack_list.push_back(response);
+    }
+    block << response;
+  }
+  if (!ack_list.empty()) {
+    ack_sm_ = std::make_unique<SubMaster>(ack_list);
+  }
+
+  std::vector<const char *> s;
   sockets_.resize(event_struct.getUnionFields().size());
   for (const auto &it : services) {
     if ((allow.empty() || allow.contains(it.name)) && !block.contains(it.name)) {
@@ -28,11 +59,12 @@ Replay::Replay(QString route, QStringList allow, QStringList block, SubMaster *s
     pm = std::make_unique<PubMaster>(s);
   }
   route_ = std::make_unique<Route>(route, data_dir);
-  events_ = std::make_unique<std::vector<Event *>>();
-  new_events_ = std::make_unique<std::vector<Event *>>();
+  // every file of a segment is a job, a few segments can download and decompress at once
+  load_pool_.setMaxThreadCount(std::clamp(QThread::idealThreadCount(), 2, 8));
 
   connect(this, &Replay::seekTo, this, &Replay::doSeek);
   connect(this, &Replay::segmentChanged, this, &Replay::queueSegment);
+  connect(this, &Replay::qcameraFallback, this, &Replay::queueSegment);
 }
 
 Replay::~Replay() {
@@ -71,6 +103,11 @@ bool Replay::load() {
     return false;
   }
   qInfo() << "load route" << route_->name() << "with" << segments_.size() << "valid segments";
+
+  index_ = std::make_unique<RouteIndex>(route_->name());
+  if (index_->load()) {
+    qInfo() << "loaded index of" << index_->segments().size() << "segments";
+  }
   return true;
 }
 
@@ -98,6 +135,15 @@ void Replay::doSeek(int seconds, bool relative) {
     }
     seconds = std::max(0, seconds);
     int seg = seconds / 60;
+    uint64_t ts = route_start_ts_ + seconds * 1e9;
+    // the index knows the segment that holds the time even if it isn't 60s long, and where
+    // the key frame before it is, so the first frame after the seek doesn't wait for a GOP to decode.
+    if (route_start_ts_ > 0) {
+      if (int n = index_->segmentAt(ts); n >= 0) {
+        seg = n;
+        ts = index_->keyframeBefore(n, RoadCam, ts);
+      }
+    }
     if (segments_.find(seg) == segments_.end()) {
       qWarning() << "can't seek to" << seconds << "s, segment" << seg << "is invalid";
       return true;
@@ -105,7 +151,8 @@ void Replay::doSeek(int seconds, bool relative) {
 
     qInfo() << "seeking to" << seconds << "s, segment" << seg;
     current_segment_ = seg;
-    cur_mono_time_ = route_start_ts_ + seconds * 1e9;
+    // the stream resumes after cur_mono_time_, step back so the events at ts, the key frame, are sent too
+    cur_mono_time_ = ts > 0 ? ts - 1 : 0;
     return isSegmentMerged(seg);
   });
   queueSegment();
@@ -129,10 +176,16 @@ void Replay::setCurrentSegment(int n) {
 }
 
 void Replay::segmentLoadFinished(bool success) {
+  Segment *seg = qobject_cast<Segment *>(sender());
   if (!success) {
-    Segment *seg = qobject_cast<Segment *>(sender());
     qWarning() << "failed to load segment " << seg->seg_num << ", removing it from current replay list";
     segments_.erase(seg->seg_num);
+  } else {
+    max_segment_size_ = std::max(max_segment_size_, seg->memoryUsage());
+    if (!index_->contains(seg->seg_num)) {
+      index_->add(seg->seg_num, seg);
+      index_->save();
+    }
   }
   queueSegment();
 }
@@ -140,34 +193,51 @@ void Replay::segmentLoadFinished(bool success) {
 void Replay::queueSegment() {
   if (segments_.empty()) return;
 
-  SegmentMap::iterator cur, end;
-  cur = end = segments_.lower_bound(std::min(current_segment_.load(), segments_.rbegin()->first));
+  SegmentMap::iterator begin, cur, end;
+  begin = cur = end = segments_.lower_bound(std::min(current_segment_.load(), segments_.rbegin()->first));
+  if (cur != segments_.begin() && std::prev(cur)->first == cur->first - 1) {
+    begin = std::prev(cur);
+  }
+  // with a memory budget, segments farthest ahead of the playhead are the first to go.
+  // the current and the next segment are always kept. unloaded segments count as the largest one seen so far.
+  size_t used = begin != cur && begin->second && begin->second->isLoaded() ? begin->second->memoryUsage() : 0;
   for (int i = 0; end != segments_.end() && i <= FORWARD_SEGS; ++i) {
+    const auto &seg = end->second;
+    used += seg && seg->isLoaded() ? seg->memoryUsage() : max_segment_size_;
+    if (memory_budget_ > 0 && i > 1 && used > memory_budget_) break;
     ++end;
   }
-  // load one segment at a time
-  for (auto it = cur; it != end; ++it) {
-    if (!it->second) {
-      if (it == cur || std::prev(it)->second->isLoaded()) {
-        auto &[n, seg] = *it;
-        seg = std::make_unique<Segment>(n, route_->at(n), flags_);
-        QObject::connect(seg.get(), &Segment::loadFinished, this, &Replay::segmentLoadFinished);
-        qDebug() << "loading segment" << n << "...";
-      }
-      break;
+
+  // load the whole window at once. the pool runs queued files by priority: the current segment,
+  // then the ones ahead nearest first, then the previous one for seeking back.
+  int distance = 0;
+  for (auto it = cur; it != end; ++it, ++distance) {
+    auto &[n, seg] = *it;
+    const int priority = FORWARD_SEGS + 1 - distance;
+    if (!seg) {
+      seg = std::make_unique<Segment>(n, route_->at(n), flags_, &load_pool_, priority);
+      QObject::connect(seg.get(), &Segment::loadFinished, this, &Replay::segmentLoadFinished);
+      qDebug() << "loading segment" << n << "...";
+    } else if (!seg->isLoaded()) {
+      // the playhead moved, reorder what hasn't started yet
+      seg->setPriority(priority);
     }
+    if (qcam_fallback_) {
+      seg->loadQcamera();
+    }
+  }
+  if (begin != cur && !begin->second) {
+    auto &[n, seg] = *begin;
+    seg = std::make_unique<Segment>(n, route_->at(n), flags_, &load_pool_, -1);
+    QObject::connect(seg.get(), &Segment::loadFinished, this, &Replay::segmentLoadFinished);
   }
   const auto &cur_segment = cur->second;
   enableHttpLogging(!cur_segment->isLoaded());
 
   // merge the previous adjacent segment if it's loaded
-  auto begin = segments_.find(cur_segment->seg_num - 1);
-  if (begin == segments_.end() || !(begin->second && begin->second->isLoaded())) {
-    begin = cur;
-  }
-  mergeSegments(begin, end);
+  mergeSegments(begin->second->isLoaded() ? begin : cur, end);
 
-  // free segments out of current semgnt window.
+  // free segments out of current semgnt window. their queued loads are cancelled.
   std::for_each(segments_.begin(), begin, [](auto &e) { e.second.reset(nullptr); });
   std::for_each(end, segments_.end(), [](auto &e) { e.second.reset(nullptr); });
 
@@ -178,26 +248,16 @@ void Replay::queueSegment() {
 }
 
 void Replay::mergeSegments(const SegmentMap::iterator &begin, const SegmentMap::iterator &end) {
-  // merge 3 segments in sequence.
+  // merge 3 segments in sequence. the stream thread walks their event lists
+  // with a k-way merge, so nothing is copied here.
   std::vector<int> segments_need_merge;
-  size_t new_events_size = 0;
   for (auto it = begin; it != end && it->second->isLoaded() && segments_need_merge.size() < 3; ++it) {
     segments_need_merge.push_back(it->first);
-    new_events_size += it->second->log->events.size();
   }
 
   if (segments_need_merge != segments_merged_) {
     qDebug() << "merge segments" << segments_need_merge;
-    new_events_->clear();
-    new_events_->reserve(new_events_size);
-    for (int n : segments_need_merge) {
-      const auto &e = segments_[n]->log->events;
-      auto middle = new_events_->insert(new_events_->end(), e.begin(), e.end());
-      std::inplace_merge(new_events_->begin(), middle, new_events_->end(), Event::lessThan());
-    }
-
     updateEvents([&]() {
-      events_.swap(new_events_);
       segments_merged_ = segments_need_merge;
       return true;
     });
@@ -228,29 +288,33 @@ void Replay::startStream(const Segment *cur_segment) {
       camera_size[type] = {fr->width, fr->height};
     }
   }
-  camera_server_ = std::make_unique<CameraServer>(camera_size, flags_ & REPLAY_FLAG_SEND_YUV);
+  const bool send_rgb = !(flags_ & REPLAY_FLAG_NO_RGB);
+  camera_server_ = std::make_unique<CameraServer>(camera_size, (flags_ & REPLAY_FLAG_SEND_YUV) || !send_rgb, send_rgb);
 
   // start stream thread
   stream_thread_ = new QThread();
   QObject::connect(stream_thread_, &QThread::started, [=]() { stream(); });
   QObject::connect(stream_thread_, &QThread::finished, stream_thread_, &QThread::deleteLater);
   stream_thread_->start();
+  emit streamStarted();
 }
 
-void Replay::publishMessage(const Event *e) {
+bool Replay::publishMessage(const Event *e) {
   if (sm == nullptr) {
     auto bytes = e->bytes();
     int ret = pm->send(sockets_[e->which], (capnp::byte *)bytes.begin(), bytes.size());
     if (ret == -1) {
       qDebug() << "stop publishing" << sockets_[e->which] << "due to multiple publishers error";
       sockets_[e->which] = nullptr;
+      return false;
     }
   } else {
     sm->update_msgs(nanos_since_boot(), {{sockets_[e->which], e->event}});
   }
+  return true;
 }
 
-void Replay::publishFrame(const Event *e) {
+bool Replay::publishFrame(const Event *e) {
   static const std::map<cereal::Event::Which, CameraType> cam_types{
       {cereal::Event::ROAD_ENCODE_IDX, RoadCam},
       {cereal::Event::DRIVER_ENCODE_IDX, DriverCam},
@@ -258,12 +322,53 @@ void Replay::publishFrame(const Event *e) {
   };
   if ((e->which == cereal::Event::DRIVER_ENCODE_IDX && !(flags_ & REPLAY_FLAG_DCAM)) ||
       (e->which == cereal::Event::WIDE_ROAD_ENCODE_IDX && !(flags_ & REPLAY_FLAG_ECAM))) {
-    return;
+    return false;
   }
   auto eidx = capnp::AnyStruct::Reader(e->event).getPointerSection()[0].getAs<cereal::EncodeIndex>();
   if (eidx.getType() == cereal::EncodeIndex::Type::FULL_H_E_V_C && isSegmentMerged(eidx.getSegmentNum())) {
     CameraType cam = cam_types.at(e->which);
-    camera_server_->pushFrame(cam, segments_[eidx.getSegmentNum()]->frames[cam].get(), eidx);
+    const auto &seg = segments_[eidx.getSegmentNum()];
+    FrameReader *fr = seg->frames[cam].get();
+    if (cam == RoadCam) {
+      updateQcameraFallback();
+      if (qcam_fallback_ && seg->qcameraFrames()) {
+        fr = seg->qcameraFrames();
+      }
+    }
+    camera_server_->pushFrame(cam, fr, eidx);
+    return true;
+  }
+  return false;
+}
+
+void Replay::updateQcameraFallback() {
+  // headless replay waits for every frame and never falls behind the log
+  if (flags_ & (REPLAY_FLAG_QCAMERA | REPLAY_FLAG_HEADLESS)) return;
+
+  const uint64_t ts = nanos_since_boot();
+  const bool behind = camera_server_->isBehind(RoadCam);
+  if (!qcam_fallback_) {
+    if (!behind) {
+      road_behind_since_ = 0;
+      return;
+    }
+    if (road_behind_since_ == 0) {
+      road_behind_since_ = ts;
+    }
+    if (ts - road_behind_since_ < QCAM_FALLBACK_DELAY_SECS * 1e9) return;
+
+    // falling behind again right after going back to full resolution, stay on qcamera longer
+    fallback_secs_ = ts - fallback_end_ < QCAM_FALLBACK_SECS * 1e9 ? std::min(fallback_secs_ * 2, 600) : QCAM_FALLBACK_SECS;
+    qWarning() << "road camera decoding can't keep up, playing qcamera for" << fallback_secs_ << "s";
+    qcam_fallback_ = true;
+    fallback_until_ = ts + fallback_secs_ * 1e9;
+    road_behind_since_ = 0;
+    emit qcameraFallback(true);
+  } else if (ts > fallback_until_ && !behind) {
+    qInfo() << "trying full resolution road camera again";
+    qcam_fallback_ = false;
+    fallback_end_ = ts;
+    emit qcameraFallback(false);
   }
 }
 
@@ -278,9 +383,15 @@ void Replay::stream() {
     events_updated_ = false;
     if (exit_) break;
 
+    std::vector<const std::vector<Event *> *> lists;
+    for (int n : segments_merged_) {
+      lists.push_back(&segments_[n]->log->events);
+    }
     Event cur_event(cur_which, cur_mono_time_);
-    auto eit = std::upper_bound(events_->begin(), events_->end(), &cur_event, Event::lessThan());
-    if (eit == events_->end()) {
+    EventMerger merger;
+    merger.reset(lists, &cur_event);
+    const Event *evt = merger.next();
+    if (evt == nullptr) {
       qDebug() << "waiting for events...";
       continue;
     }
@@ -288,8 +399,7 @@ void Replay::stream() {
     uint64_t evt_start_ts = cur_mono_time_;
     uint64_t loop_start_ts = nanos_since_boot();
 
-    for (auto end = events_->end(); !updating_events_ && eit != end; ++eit) {
-      const Event *evt = (*eit);
+    for (; !updating_events_ && evt != nullptr; evt = merger.next()) {
       cur_which = evt->which;
       cur_mono_time_ = evt->mono_time;
       const int current_ts = currentSeconds();
@@ -309,7 +419,7 @@ void Replay::stream() {
       }
 
       if (cur_which < sockets_.size() && sockets_[cur_which] != nullptr) {
-        // keep time
+        // keep time. headless replay runs as fast as the consumers keep up.
         long etime = cur_mono_time_ - evt_start_ts;
         long rtime = nanos_since_boot() - loop_start_ts;
         long behind_ns = etime - rtime;
@@ -318,26 +428,62 @@ void Replay::stream() {
           // reset start times
           evt_start_ts = cur_mono_time_;
           loop_start_ts = nanos_since_boot();
-        } else if (behind_ns > 0) {
+        } else if (behind_ns > 0 && !(flags_ & REPLAY_FLAG_HEADLESS)) {
           precise_nano_sleep(behind_ns);
         }
 
+        const uint64_t sent_ts = nanos_since_boot();
+        bool sent;
         if (evt->frame) {
-          publishFrame(evt);
+          sent = publishFrame(evt);
+          if (flags_ & REPLAY_FLAG_HEADLESS) {
+            camera_server_->waitFinish();
+          }
         } else {
-          publishMessage(evt);
+          sent = publishMessage(evt);
+        }
+
+        if (auto it = ack_services_.find(cur_which); sent && it != ack_services_.end()) {
+          waitForAck(it->second, sent_ts);
         }
       }
     }
     // wait for frame to be sent before unlock.(frameReader may be deleted after unlock)
     camera_server_->waitFinish();
 
-    if (eit == events_->end() && !(flags_ & REPLAY_FLAG_NO_LOOP)) {
+    if (evt == nullptr) {
       int last_segment = segments_.rbegin()->first;
       if (current_segment_ >= last_segment && isSegmentMerged(last_segment)) {
-        qInfo() << "reaches the end of route, restart from beginning";
-        emit seekTo(0, false);
+        if (flags_ & REPLAY_FLAG_HEADLESS) {
+          qInfo() << "reaches the end of route";
+          emit streamFinished();
+        } else if (!(flags_ & REPLAY_FLAG_NO_LOOP)) {
+          qInfo() << "reaches the end of route, restart from beginning";
+          emit seekTo(0, false);
+        }
+      }
+    }
+  }
+}
+
+void Replay::waitForAck(const std::vector<const char *> &services, uint64_t sent_ts) {
+  // the consumers are done with the event once each of them has published a response. responses
+  // built before it was sent are late ones for an earlier step that timed out, and are skipped.
+  std::vector<bool> acked(services.size());
+  const double start_ts = millis_since_boot();
+  while (!updating_events_) {
+    ack_sm_->update(10);
+    for (int i = 0; i < services.size(); ++i) {
+      if (ack_sm_->updated(services[i]) && (*ack_sm_)[services[i]].getLogMonoTime() >= sent_ts) {
+        acked[i] = true;
       }
     }
+    if (std::all_of(acked.begin(), acked.end(), [](bool a) { return a; })) {
+      return;
+    }
+    if (millis_since_boot() - start_ts > ACK_TIMEOUT_MS) {
+      qWarning() << "timeout waiting for" << QVector<const char *>(services.begin(), services.end());
+      return;
+    }
   }
 }
@@ -4,9 +4,14 @@
 
 #include "selfdrive/ui/replay/camera.h"
 #include "selfdrive/ui/replay/route.h"
+#include "selfdrive/ui/replay/routeindex.h"
 
 // one segment uses about 100M of memory
 constexpr int FORWARD_SEGS = 5;
+// how long the road camera has to stay behind before switching to qcamera, and the first
+// stretch played from qcamera before trying full resolution again
+constexpr int QCAM_FALLBACK_DELAY_SECS = 3;
+constexpr int QCAM_FALLBACK_SECS = 30;
 
 enum REPLAY_FLAGS {
   REPLAY_FLAG_NONE = 0x0000,
@@ -17,6 +22,9 @@ enum REPLAY_FLAGS {
   REPLAY_FLAG_QCAMERA = 0x0040,
   REPLAY_FLAG_SEND_YUV = 0x0080,
   REPLAY_FLAG_NO_CUDA = 0x0100,
+  REPLAY_FLAG_NO_RGB = 0x0200,
+  REPLAY_FLAG_HEADLESS = 0x0400,
+  REPLAY_FLAG_SPILL_LOGS = 0x0800,
 };
 
 class Replay : public QObject {
@@ -24,17 +32,24 @@ class Replay : public QObject {
 
 public:
   Replay(QString route, QStringList allow, QStringList block, SubMaster *sm = nullptr,
-          uint32_t flags = REPLAY_FLAG_NONE, QString data_dir = "", QObject *parent = 0);
+          uint32_t flags = REPLAY_FLAG_NONE, QString data_dir = "", QStringList ack = {}, QObject *parent = 0);
   ~Replay();
   bool load();
   void start(int seconds = 0);
   void stop();
   void pause(bool pause);
   bool isPaused() const { return paused_; }
+  // segment time ranges, key frames and a coarse timeline. only holds segments loaded at some point.
+  const RouteIndex *routeIndex() const { return index_.get(); }
+  // bytes of loaded segments to keep around the current one. 0 keeps FORWARD_SEGS ahead regardless of size.
+  void setMemoryBudget(size_t bytes) { memory_budget_ = bytes; }
 
 signals:
   void segmentChanged();
   void seekTo(int seconds, bool relative);
+  void streamStarted();
+  void streamFinished();
+  void qcameraFallback(bool enabled);
 
 protected slots:
   void queueSegment();
@@ -48,8 +63,11 @@ protected:
   void setCurrentSegment(int n);
   void mergeSegments(const SegmentMap::iterator &begin, const SegmentMap::iterator &end);
   void updateEvents(const std::function<bool()>& lambda);
-  void publishMessage(const Event *e);
-  void publishFrame(const Event *e);
+  // return false if nothing was sent
+  bool publishMessage(const Event *e);
+  bool publishFrame(const Event *e);
+  void waitForAck(const std::vector<const char *> &services, uint64_t sent_ts);
+  void updateQcameraFallback();
   inline int currentSeconds() const { return (cur_mono_time_ - route_start_ts_) / 1e9; }
   inline bool isSegmentMerged(int n) {
     return std::find(segments_merged_.begin(), segments_merged_.end(), n) != segments_merged_.end();
@@ -62,6 +80,8 @@ protected:
   std::condition_variable stream_cv_;
   std::atomic<bool> updating_events_ = false;
   std::atomic<int> current_segment_ = 0;
+  // shared by the segments' file loads, must outlive segments_
+  QThreadPool load_pool_;
   SegmentMap segments_;
   // the following variables must be protected with stream_lock_
   bool exit_ = false;
@@ -69,8 +89,6 @@ protected:
   bool events_updated_ = false;
   uint64_t route_start_ts_ = 0;
   uint64_t cur_mono_time_ = 0;
-  std::unique_ptr<std::vector<Event *>> events_;
-  std::unique_ptr<std::vector<Event *>> new_events_;
   std::vector<int> segments_merged_;
 
   // messaging
@@ -78,6 +96,20 @@ protected:
   std::unique_ptr<PubMaster> pm;
   std::vector<const char*> sockets_;
   std::unique_ptr<Route> route_;
+  std::unique_ptr<RouteIndex> index_;
   std::unique_ptr<CameraServer> camera_server_;
   uint32_t flags_ = REPLAY_FLAG_NONE;
+  size_t memory_budget_ = 0;
+  size_t max_segment_size_ = 0;
+
+  // road camera played from qcamera because full resolution decoding can't keep up. only used by the stream thread.
+  std::atomic<bool> qcam_fallback_ = false;
+  uint64_t road_behind_since_ = 0;
+  uint64_t fallback_until_ = 0;
+  uint64_t fallback_end_ = 0;
+  int fallback_secs_ = QCAM_FALLBACK_SECS;
+
+  // services the consumers publish in response to a replayed service
+  std::map<cereal::Event::Which, std::vector<const char *>> ack_services_;
+  std::unique_ptr<SubMaster> ack_sm_;
 };
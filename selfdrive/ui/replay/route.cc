@@ -5,7 +5,6 @@
 #include <QJsonArray>
 #include <QJsonDocument>
 #include <QRegExp>
-#include <QtConcurrent>
 
 #include "selfdrive/hardware/hw.h"
 #include "selfdrive/ui/qt/api.h"
@@ -76,6 +75,8 @@ void Route::addFileToSegment(int n, const QString &file) {
     segments_[n].rlog = file;
   } else if (name == "qlog.bz2") {
     segments_[n].qlog = file;
+  } else if (name == "rcan.bz2") {
+    segments_[n].can = file;
   } else if (name == "fcamera.hevc") {
     segments_[n].road_cam = file;
   } else if (name == "dcamera.hevc") {
@@ -89,7 +90,8 @@ void Route::addFileToSegment(int n, const QString &file) {
 
 // class Segment
 
-Segment::Segment(int n, const SegmentFile &files, uint32_t flags) : seg_num(n), flags(flags) {
+Segment::Segment(int n, const SegmentFile &files, uint32_t flags, QThreadPool *pool, int priority)
+    : seg_num(n), pool_(pool), priority_(priority), flags(flags) {
   // [RoadCam, DriverCam, WideRoadCam, log]. fallback to qcamera/qlog
   const QString file_list[] = {
       (flags & REPLAY_FLAG_QCAMERA) || files.road_cam.isEmpty() ? files.qcamera : files.road_cam,
@@ -97,30 +99,97 @@ Segment::Segment(int n, const SegmentFile &files, uint32_t flags) : seg_num(n),
       flags & REPLAY_FLAG_ECAM ? files.wide_road_cam : "",
       files.rlog.isEmpty() ? files.qlog : files.rlog,
   };
+  // can/sendcan of this rlog were logged in columnar form
+  if (!files.rlog.isEmpty()) {
+    can_log_ = files.can.toStdString();
+  }
+  if (file_list[0] != files.qcamera) {
+    qcamera_file_ = files.qcamera.toStdString();
+  }
   for (int i = 0; i < std::size(file_list); i++) {
     if (!file_list[i].isEmpty()) {
-      loading_++;
-      synchronizer_.addFuture(QtConcurrent::run([=] { loadFile(i, file_list[i].toStdString()); }));
+      loads_.push_back(std::make_unique<FileLoad>(this, i, file_list[i].toStdString()));
     }
   }
+  loading_ = pending_ = loads_.size();
+  for (auto &load : loads_) {
+    pool_->start(load.get(), priority);
+  }
 }
 
 Segment::~Segment() {
   disconnect();
   abort_ = true;
-  synchronizer_.setCancelOnWait(true);
-  synchronizer_.waitForFinished();
+  // loads that haven't started are dropped, running ones see abort_ and return early
+  std::unique_lock lk(pending_lock_);
+  for (auto &load : loads_) {
+    if (pool_->tryTake(load.get())) {
+      --pending_;
+    }
+  }
+  pending_cv_.wait(lk, [this] { return pending_ == 0; });
+}
+
+void Segment::setPriority(int priority) {
+  priority_ = priority;
+  for (auto &load : loads_) {
+    if (pool_->tryTake(load.get())) {
+      pool_->start(load.get(), priority);
+    }
+  }
+}
+
+void Segment::loadQcamera() {
+  if (qcamera_file_.empty() || abort_) return;
+
+  // doesn't count towards isLoaded(), playback uses it once it's ready
+  loads_.push_back(std::make_unique<FileLoad>(this, QCAMERA_ID, qcamera_file_));
+  qcamera_file_.clear();
+  {
+    std::lock_guard lk(pending_lock_);
+    ++pending_;
+  }
+  pool_->start(loads_.back().get(), priority_);
+}
+
+void Segment::FileLoad::run() {
+  seg->loadFile(id, file);
+  std::lock_guard lk(seg->pending_lock_);
+  if (--seg->pending_ == 0) {
+    seg->pending_cv_.notify_one();
+  }
+}
+
+size_t Segment::memoryUsage() const {
+  size_t bytes = log ? log->memoryUsage() : 0;
+  for (const auto &fr : frames) {
+    bytes += fr ? fr->memoryUsage() : 0;
+  }
+  if (auto fr = qcameraFrames()) {
+    bytes += fr->memoryUsage();
+  }
+  return bytes;
 }
 
 void Segment::loadFile(int id, const std::string file) {
   const bool local_cache = !(flags & REPLAY_FLAG_NO_FILE_CACHE);
   bool success = false;
-  if (id < MAX_CAMERAS) {
+  if (id == QCAMERA_ID) {
+    auto fr = std::make_unique<FrameReader>();
+    if (fr->load(file, flags & REPLAY_FLAG_NO_CUDA, &abort_, local_cache, 20 * 1024 * 1024, 3)) {
+      qcamera_ = std::move(fr);
+      qcamera_ready_ = true;
+    }
+    return;
+  } else if (id < MAX_CAMERAS) {
     frames[id] = std::make_unique<FrameReader>();
     success = frames[id]->load(file, flags & REPLAY_FLAG_NO_CUDA, &abort_, local_cache, 20 * 1024 * 1024, 3);
   } else {
-    log = std::make_unique<LogReader>();
+    log = std::make_unique<LogReader>(DEFAULT_EVENT_MEMORY_POOL_BLOCK_SIZE, flags & REPLAY_FLAG_SPILL_LOGS);
     success = log->load(file, &abort_, local_cache, 0, 3);
+    if (success && !can_log_.empty()) {
+      success = log->loadCanLog(can_log_, &abort_, local_cache, 0, 3);
+    }
   }
 
   if (!success) {
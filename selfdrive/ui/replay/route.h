@@ -1,6 +1,10 @@
 #pragma once
 
-#include <QFutureSynchronizer>
+#include <condition_variable>
+#include <mutex>
+
+#include <QRunnable>
+#include <QThreadPool>
 
 #include "selfdrive/ui/replay/framereader.h"
 #include "selfdrive/ui/replay/logreader.h"
@@ -16,6 +20,7 @@ struct RouteIdentifier {
 struct SegmentFile {
   QString rlog;
   QString qlog;
+  QString can;
   QString road_cam;
   QString driver_cam;
   QString wide_road_cam;
@@ -46,9 +51,16 @@ class Segment : public QObject {
   Q_OBJECT
 
 public:
-  Segment(int n, const SegmentFile &files, uint32_t flags);
+  // files are loaded on pool. queued loads with a higher priority run first.
+  Segment(int n, const SegmentFile &files, uint32_t flags, QThreadPool *pool = QThreadPool::globalInstance(), int priority = 0);
   ~Segment();
   inline bool isLoaded() const { return !loading_ && !abort_; }
+  size_t memoryUsage() const;
+  // reorder loads that haven't started yet
+  void setPriority(int priority);
+  // also load the qcamera next to a full resolution road camera, for when decoding can't keep up
+  void loadQcamera();
+  inline FrameReader *qcameraFrames() const { return qcamera_ready_ ? qcamera_.get() : nullptr; }
 
   const int seg_num = 0;
   std::unique_ptr<LogReader> log;
@@ -58,10 +70,30 @@ signals:
   void loadFinished(bool success);
 
 protected:
+  class FileLoad : public QRunnable {
+  public:
+    FileLoad(Segment *seg, int id, const std::string &file) : seg(seg), id(id), file(file) { setAutoDelete(false); }
+    void run() override;
+
+    Segment *seg;
+    const int id;
+    const std::string file;
+  };
   void loadFile(int id, const std::string file);
+  static constexpr int QCAMERA_ID = MAX_CAMERAS + 1;
 
   std::atomic<bool> abort_ = false;
   std::atomic<int> loading_ = 0;
-  QFutureSynchronizer<void> synchronizer_;
+  QThreadPool *pool_;
+  int priority_;
+  std::vector<std::unique_ptr<FileLoad>> loads_;
+  // loads that are queued or running, the destructor waits for them
+  int pending_ = 0;
+  std::mutex pending_lock_;
+  std::condition_variable pending_cv_;
   uint32_t flags;
+  std::string can_log_;
+  std::string qcamera_file_;
+  std::unique_ptr<FrameReader> qcamera_;
+  std::atomic<bool> qcamera_ready_ = false;
 };
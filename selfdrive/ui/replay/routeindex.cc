@@ -0,0 +1,149 @@
+#include "selfdrive/ui/replay/routeindex.h"
+
+#include <QDataStream>
+#include <QFile>
+#include <QSaveFile>
+
+#include "selfdrive/ui/replay/route.h"
+#include "selfdrive/ui/replay/util.h"
+
+namespace {
+
+const quint32 ROUTE_INDEX_MAGIC = 0x58444952;  // "RIDX"
+const quint32 ROUTE_INDEX_VERSION = 1;
+
+}  // namespace
+
+RouteIndex::RouteIndex(const QString &route_name) {
+  path_ = QString::fromStdString(cacheDirectory() + "route_" + sha256(route_name.toStdString()) + ".idx");
+}
+
+bool RouteIndex::load() {
+  QFile f(path_);
+  if (!f.open(QIODevice::ReadOnly)) return false;
+
+  QDataStream in(&f);
+  quint32 magic, version, count;
+  in >> magic >> version >> count;
+  if (magic != ROUTE_INDEX_MAGIC || version != ROUTE_INDEX_VERSION) return false;
+
+  std::map<int, SegmentIndex> segments;
+  for (quint32 i = 0; i < count && in.status() == QDataStream::Ok; ++i) {
+    qint32 n;
+    quint64 start_ts, end_ts;
+    in >> n >> start_ts >> end_ts;
+    SegmentIndex &seg = segments[n];
+    seg.start_ts = start_ts;
+    seg.end_ts = end_ts;
+    for (auto &keyframes : seg.keyframes) {
+      quint32 size;
+      in >> size;
+      for (quint32 j = 0; j < size && in.status() == QDataStream::Ok; ++j) {
+        quint32 frame;
+        quint64 ts;
+        in >> frame >> ts;
+        keyframes.push_back({frame, ts});
+      }
+    }
+    quint32 buckets;
+    in >> buckets;
+    for (quint32 j = 0; j < buckets && in.status() == QDataStream::Ok; ++j) {
+      auto &bucket = seg.buckets.emplace_back();
+      quint8 engaged, alert_status;
+      quint32 types;
+      in >> engaged >> alert_status >> types;
+      bucket.engaged = engaged;
+      bucket.alert_status = alert_status;
+      for (quint32 k = 0; k < types && in.status() == QDataStream::Ok; ++k) {
+        quint16 which;
+        quint32 cnt;
+        in >> which >> cnt;
+        bucket.events[which] = cnt;
+      }
+    }
+  }
+  if (in.status() != QDataStream::Ok) return false;
+
+  segments_ = std::move(segments);
+  return true;
+}
+
+bool RouteIndex::save() const {
+  QSaveFile f(path_);
+  if (!f.open(QIODevice::WriteOnly)) return false;
+
+  QDataStream out(&f);
+  out << ROUTE_INDEX_MAGIC << ROUTE_INDEX_VERSION << (quint32)segments_.size();
+  for (const auto &[n, seg] : segments_) {
+    out << (qint32)n << (quint64)seg.start_ts << (quint64)seg.end_ts;
+    for (const auto &keyframes : seg.keyframes) {
+      out << (quint32)keyframes.size();
+      for (const auto &[frame, ts] : keyframes) {
+        out << (quint32)frame << (quint64)ts;
+      }
+    }
+    out << (quint32)seg.buckets.size();
+    for (const auto &bucket : seg.buckets) {
+      out << (quint8)bucket.engaged << (quint8)bucket.alert_status << (quint32)bucket.events.size();
+      for (const auto &[which, cnt] : bucket.events) {
+        out << (quint16)which << (quint32)cnt;
+      }
+    }
+  }
+  return f.commit();
+}
+
+void RouteIndex::add(int n, const Segment *seg) {
+  static const std::map<cereal::Event::Which, CameraType> cam_types{
+      {cereal::Event::ROAD_ENCODE_IDX, RoadCam},
+      {cereal::Event::DRIVER_ENCODE_IDX, DriverCam},
+      {cereal::Event::WIDE_ROAD_ENCODE_IDX, WideRoadCam},
+  };
+  const auto &events = seg->log->events;
+  if (events.empty()) return;
+
+  SegmentIndex idx;
+  idx.start_ts = events.front()->mono_time;
+  idx.end_ts = events.back()->mono_time;
+  for (const Event *e : events) {
+    if (e->frame) {
+      // frame events are copies of encodeIdx, only used for the key frames
+      auto eidx = capnp::AnyStruct::Reader(e->event).getPointerSection()[0].getAs<cereal::EncodeIndex>();
+      CameraType cam = cam_types.at(e->which);
+      const auto &fr = seg->frames[cam];
+      if (eidx.getType() == cereal::EncodeIndex::Type::FULL_H_E_V_C && fr && fr->isKeyFrame(eidx.getSegmentId())) {
+        idx.keyframes[cam].push_back({eidx.getSegmentId(), e->mono_time});
+      }
+      continue;
+    }
+
+    const size_t b = (e->mono_time - idx.start_ts) / (TIMELINE_BUCKET_SECONDS * 1e9);
+    if (b >= idx.buckets.size()) {
+      idx.buckets.resize(b + 1);
+    }
+    auto &bucket = idx.buckets[b];
+    bucket.events[e->which]++;
+    if (e->which == cereal::Event::CONTROLS_STATE) {
+      auto cs = e->event.getControlsState();
+      bucket.engaged |= cs.getEnabled();
+      bucket.alert_status = std::max(bucket.alert_status, (uint8_t)cs.getAlertStatus());
+    }
+  }
+  segments_[n] = std::move(idx);
+}
+
+int RouteIndex::segmentAt(uint64_t ts) const {
+  for (const auto &[n, seg] : segments_) {
+    if (ts >= seg.start_ts && ts <= seg.end_ts) return n;
+  }
+  return -1;
+}
+
+uint64_t RouteIndex::keyframeBefore(int n, CameraType cam, uint64_t ts) const {
+  auto it = segments_.find(n);
+  if (it == segments_.end()) return ts;
+
+  const auto &keyframes = it->second.keyframes[cam];
+  auto kf = std::upper_bound(keyframes.begin(), keyframes.end(), ts, [](uint64_t t, auto &k) { return t < k.second; });
+  return kf != keyframes.begin() ? std::prev(kf)->second : ts;
+}
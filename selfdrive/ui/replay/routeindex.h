@@ -0,0 +1,48 @@
+#pragma once
+
+#include <map>
+#include <vector>
+
+#include <QString>
+
+#include "selfdrive/ui/replay/logreader.h"
+
+class Segment;
+
+const int TIMELINE_BUCKET_SECONDS = 5;
+
+struct SegmentIndex {
+  uint64_t start_ts = 0, end_ts = 0;
+  // key frames of each camera as (frame index in the segment's video, timestamp)
+  std::vector<std::pair<uint32_t, uint64_t>> keyframes[MAX_CAMERAS];
+
+  // one bucket per TIMELINE_BUCKET_SECONDS from start_ts
+  struct Bucket {
+    bool engaged = false;
+    uint8_t alert_status = 0;  // highest cereal::ControlsState::AlertStatus
+    std::map<uint16_t, uint32_t> events;  // event count by cereal::Event::Which
+  };
+  std::vector<Bucket> buckets;
+};
+
+// a small sidecar with what replay needs to seek and draw a timeline without loading segments.
+// segments are added as they are loaded and the index is saved next to the download cache,
+// so it is complete after the route has been played through once.
+class RouteIndex {
+public:
+  RouteIndex(const QString &route_name);
+  bool load();
+  bool save() const;
+  // index a loaded segment
+  void add(int n, const Segment *seg);
+  inline bool contains(int n) const { return segments_.count(n) > 0; }
+  inline const std::map<int, SegmentIndex> &segments() const { return segments_; }
+  // the indexed segment whose time range contains ts, -1 if there is none
+  int segmentAt(uint64_t ts) const;
+  // timestamp of the last key frame at or before ts, ts if it isn't known
+  uint64_t keyframeBefore(int n, CameraType cam, uint64_t ts) const;
+
+private:
+  QString path_;
+  std::map<int, SegmentIndex> segments_;
+};
@@ -1,16 +1,22 @@
 #include "selfdrive/ui/replay/util.h"
 
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <bzlib.h>
 #include <curl/curl.h>
 #include <openssl/sha.h>
 
+#include <algorithm>
 #include <cstring>
 #include <cassert>
 #include <cmath>
+#include <condition_variable>
 #include <fstream>
 #include <iostream>
 #include <mutex>
 #include <numeric>
+#include <thread>
 
 #include "selfdrive/common/timing.h"
 #include "selfdrive/common/util.h"
@@ -26,15 +32,26 @@ struct CURLGlobalInitializer {
 
 template <class T>
 struct MultiPartWriter {
+  CURL *handle;
   T *buf;
   size_t *total_written;
   size_t offset;
   size_t end;
+  bool whole_file;
+  bool checked = false;
 
   size_t write(char *data, size_t size, size_t count) {
     size_t bytes = size * count;
     if ((offset + bytes) > end) return 0;
 
+    if (!checked) {
+      // a server that ignores the range sends the whole file, which is only usable if that's what was asked for
+      long res_status = 0;
+      curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &res_status);
+      if (res_status != 206 && !(res_status == 200 && whole_file)) return 0;
+      checked = true;
+    }
+
     if constexpr (std::is_same<T, std::string>::value) {
       memcpy(buf->data() + offset, data, bytes);
     } else if constexpr (std::is_same<T, std::ofstream>::value) {
@@ -96,32 +113,39 @@ void enableHttpLogging(bool enable) {
   enable_http_logging = enable;
 }
 
+// downloads bytes [start, content_length). completed is set to the end of the bytes
+// that were downloaded without a gap from start, and passed to on_progress about once a second.
 template <class T>
-bool httpDownload(const std::string &url, T &buf, size_t chunk_size, size_t content_length, std::atomic<bool> *abort) {
+bool httpDownload(const std::string &url, T &buf, size_t chunk_size, size_t content_length, std::atomic<bool> *abort,
+                  size_t start = 0, size_t *completed = nullptr, const std::function<void(size_t)> &on_progress = nullptr) {
   static CURLGlobalInitializer curl_initializer;
 
   int parts = 1;
-  if (chunk_size > 0 && content_length > 10 * 1024 * 1024) {
-    parts = std::nearbyint(content_length / (float)chunk_size);
+  if (chunk_size > 0 && content_length - start > 10 * 1024 * 1024) {
+    parts = std::nearbyint((content_length - start) / (float)chunk_size);
     parts = std::clamp(parts, 1, 5);
   }
 
   CURLM *cm = curl_multi_init();
   size_t written = 0;
   std::map<CURL *, MultiPartWriter<T>> writers;
-  const int part_size = content_length / parts;
+  CURL *first_part = nullptr;
+  const size_t part_size = (content_length - start) / parts;
   for (int i = 0; i < parts; ++i) {
     CURL *eh = curl_easy_init();
     writers[eh] = {
+        .handle = eh,
         .buf = &buf,
         .total_written = &written,
-        .offset = (size_t)(i * part_size),
-        .end = i == parts - 1 ? content_length : (i + 1) * part_size,
+        .offset = start + i * part_size,
+        .end = i == parts - 1 ? content_length : start + (i + 1) * part_size,
+        .whole_file = start == 0 && parts == 1,
     };
+    if (i == 0) first_part = eh;
     curl_easy_setopt(eh, CURLOPT_WRITEFUNCTION, write_cb<T>);
     curl_easy_setopt(eh, CURLOPT_WRITEDATA, (void *)(&writers[eh]));
     curl_easy_setopt(eh, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(eh, CURLOPT_RANGE, util::string_format("%d-%d", writers[eh].offset, writers[eh].end - 1).c_str());
+    curl_easy_setopt(eh, CURLOPT_RANGE, util::string_format("%zu-%zu", writers[eh].offset, writers[eh].end - 1).c_str());
     curl_easy_setopt(eh, CURLOPT_HTTPGET, 1);
     curl_easy_setopt(eh, CURLOPT_NOSIGNAL, 1);
     curl_easy_setopt(eh, CURLOPT_FOLLOWLOCATION, 1);
@@ -131,11 +155,19 @@ bool httpDownload(const std::string &url, T &buf, size_t chunk_size, size_t cont
 
   size_t prev_written = 0;
   double last_print = millis_since_boot();
+  double last_progress = last_print;
   int still_running = 1;
   while (still_running > 0 && !(abort && *abort)) {
     curl_multi_wait(cm, nullptr, 0, 1000, nullptr);
     curl_multi_perform(cm, &still_running);
 
+    if (on_progress) {
+      if (double ts = millis_since_boot(); (ts - last_progress) > 1000) {
+        on_progress(writers[first_part].offset);
+        last_progress = ts;
+      }
+    }
+
     if (enable_http_logging) {
       if (double ts = millis_since_boot(); (ts - last_print) > 2 * 1000) {
         size_t average = (written - prev_written) / ((ts - last_print) / 1000.);
@@ -156,7 +188,7 @@ bool httpDownload(const std::string &url, T &buf, size_t chunk_size, size_t cont
       if (msg->data.result == CURLE_OK) {
         long res_status = 0;
         curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &res_status);
-        if (res_status == 206) {
+        if (res_status == 206 || (res_status == 200 && writers[msg->easy_handle].whole_file)) {
           complete++;
         } else {
           std::cout << "Download failed: http error code: " << res_status << std::endl;
@@ -167,6 +199,9 @@ bool httpDownload(const std::string &url, T &buf, size_t chunk_size, size_t cont
     }
   }
 
+  if (completed) {
+    *completed = writers[first_part].offset;
+  }
   for (const auto &[e, w] : writers) {
     curl_multi_remove_handle(cm, e);
     curl_easy_cleanup(e);
@@ -188,49 +223,335 @@ bool httpDownload(const std::string &url, const std::string &file, size_t chunk_
   size_t size = getRemoteFileSize(url);
   if (size == 0) return false;
 
-  std::ofstream of(file, std::ios::binary | std::ios::out);
-  of.seekp(size - 1).write("\0", 1);
-  return httpDownload(url, of, chunk_size, size, abort);
+  // parts are downloaded in parallel, so a killed download leaves holes before the end of file.
+  // <file>.offset holds the length of the start of file that is complete, a torn write of it
+  // only makes it shorter. without it the download starts over.
+  const std::string offset_file = file + ".offset";
+  auto save_offset = [&](size_t offset) {
+    std::string s = std::to_string(offset);
+    util::write_file(offset_file.c_str(), s.data(), s.size(), O_WRONLY | O_CREAT | O_TRUNC);
+  };
+  struct stat st = {};
+  size_t start = stat(file.c_str(), &st) == 0 ? strtoull(util::read_file(offset_file).c_str(), nullptr, 10) : 0;
+  if (start > (size_t)st.st_size || start > size) start = 0;
+
+  bool ret = start == size;
+  size_t completed = start;
+  if (!ret) {
+    std::ofstream of(file, std::ios::binary | std::ios::out | (start > 0 ? std::ios::in : std::ios::trunc));
+    ret = httpDownload(url, of, chunk_size, size, abort, start, &completed, [&](size_t offset) {
+      // the bytes have to be in the file before the offset says so
+      if (of.flush().good()) save_offset(offset);
+    });
+    ret = ret && of.good();
+  }
+  if (ret) {
+    unlink(offset_file.c_str());
+  } else if (truncate(file.c_str(), completed) == 0) {
+    save_offset(completed);
+  } else {
+    // a file longer than its offset would be resumed at the wrong place
+    unlink(file.c_str());
+    unlink(offset_file.c_str());
+  }
+  return ret;
 }
 
-std::string decompressBZ2(const std::string &in) {
-  return decompressBZ2((std::byte *)in.data(), in.size());
+namespace {
+
+// bz2 streams are a sequence of independently compressed blocks, each starting with a 48 bit magic
+// at an arbitrary bit offset and carrying its own CRC. A block is turned into a standalone stream by
+// prepending a stream header and appending an end-of-stream marker whose combined CRC is the block CRC.
+const uint64_t BZ2_BLOCK_MAGIC = 0x314159265359;
+const uint64_t BZ2_EOS_MAGIC = 0x177245385090;
+const uint64_t BZ2_MAGIC_MASK = (1ULL << 48) - 1;
+const size_t BZ2_PARALLEL_MIN_SIZE = 1024 * 1024;
+
+// worker threads of all concurrent decompressions come out of one budget of hardware_concurrency,
+// so e.g. replay loading several segments at once doesn't start that many threads per segment.
+std::atomic<int> bz2_free_threads = std::max(1u, std::thread::hardware_concurrency());
+
+struct BZ2Threads {
+  // takes up to `wanted` threads, none if fewer than 2 are free
+  BZ2Threads(int wanted) {
+    int free = bz2_free_threads.load();
+    do {
+      count = std::min(wanted, free);
+      if (count < 2) {
+        count = 0;
+        return;
+      }
+    } while (!bz2_free_threads.compare_exchange_weak(free, free - count));
+  }
+  ~BZ2Threads() { bz2_free_threads += count; }
+  int count;
+};
+
+struct BZ2Marker {
+  uint64_t bit;
+  bool eos;
+};
+
+inline uint32_t readBits(const uint8_t *in, uint64_t bit, int n) {
+  uint32_t v = 0;
+  for (int i = 0; i < n; ++i, ++bit) {
+    v = (v << 1) | ((in[bit / 8] >> (7 - bit % 8)) & 1);
+  }
+  return v;
 }
 
-std::string decompressBZ2(const std::byte *in, size_t in_size) {
-  if (in_size == 0) return {};
+struct BitWriter {
+  std::string buf;
+  uint32_t acc = 0;
+  int nbits = 0;
+
+  void put(uint64_t v, int n) {
+    while (n-- > 0) {
+      acc = (acc << 1) | ((v >> n) & 1);
+      if (++nbits == 8) {
+        buf.push_back((char)acc);
+        acc = nbits = 0;
+      }
+    }
+  }
+  // copy bits [begin, end) of in, must be called while byte aligned
+  void copy(const uint8_t *in, uint64_t begin, uint64_t end) {
+    const int shift = begin % 8;
+    const uint8_t *p = in + begin / 8;
+    const uint64_t full_bytes = (end - begin) / 8;
+    const size_t offset = buf.size();
+    buf.resize(offset + full_bytes);
+    for (uint64_t i = 0; i < full_bytes; ++i) {
+      buf[offset + i] = shift == 0 ? p[i] : (uint8_t)((p[i] << shift) | (p[i + 1] >> (8 - shift)));
+    }
+    const uint64_t tail = begin + full_bytes * 8;
+    put(readBits(in, tail, end - tail), end - tail);
+  }
+  void flush() {
+    if (nbits > 0) put(0, 8 - nbits);
+  }
+};
+
+std::vector<BZ2Marker> findBZ2Markers(const uint8_t *in, size_t size, int threads) {
+  // the byte before the last one of a match is fully covered by the magic, which leaves
+  // only a handful of possible values for it. use that to skip most bytes cheaply.
+  bool candidate[256] = {};
+  for (int shift = 0; shift < 8; ++shift) {
+    candidate[(BZ2_BLOCK_MAGIC >> (8 - shift)) & 0xff] = true;
+    candidate[(BZ2_EOS_MAGIC >> (8 - shift)) & 0xff] = true;
+  }
+
+  std::vector<std::vector<BZ2Marker>> found(threads);
+  const size_t chunk = (size + threads - 1) / threads;
+  auto scan = [&](int t) {
+    const size_t begin = std::min(size, t * chunk), end = std::min(size, begin + chunk);
+    uint64_t window = 0;
+    // warm up the window with the bytes before the chunk, matches ending inside the chunk are ours
+    for (size_t i = begin > 6 ? begin - 6 : 0; i < end; ++i) {
+      window = (window << 8) | in[i];
+      if (i < begin || (i + 1) * 8 < 48 || !candidate[in[i - 1]]) continue;
+      for (int shift = 7; shift >= 0; --shift) {
+        const uint64_t start_bit = (i + 1) * 8 - 48 - shift;
+        if (start_bit > (i + 1) * 8) continue;
+        const uint64_t v = (window >> shift) & BZ2_MAGIC_MASK;
+        if (v == BZ2_BLOCK_MAGIC || v == BZ2_EOS_MAGIC) {
+          found[t].push_back({start_bit, v == BZ2_EOS_MAGIC});
+        }
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; ++t) workers.emplace_back(scan, t);
+  for (auto &w : workers) w.join();
+
+  std::vector<BZ2Marker> markers;
+  for (auto &f : found) markers.insert(markers.end(), f.begin(), f.end());
+  return markers;
+}
+
+// decompress a single block spanning bits [begin, end)
+bool decompressBZ2Block(const uint8_t *in, uint64_t begin, uint64_t end, std::string &out) {
+  BitWriter w;
+  w.buf = "BZh9";
+  w.copy(in, begin, end);
+  w.put(BZ2_EOS_MAGIC, 48);
+  w.put(readBits(in, begin + 48, 32), 32);
+  w.flush();
+
+  bz_stream strm = {};
+  int bzerror = BZ2_bzDecompressInit(&strm, 0, 0);
+  assert(bzerror == BZ_OK);
+  strm.next_in = w.buf.data();
+  strm.avail_in = w.buf.size();
+  out.resize(1024 * 1024);
+  while (true) {
+    strm.next_out = &out[strm.total_out_lo32];
+    strm.avail_out = out.size() - strm.total_out_lo32;
+    bzerror = BZ2_bzDecompress(&strm);
+    if (bzerror != BZ_OK || (strm.avail_out > 0 && strm.avail_in == 0)) break;
+    if (strm.avail_out == 0) out.resize(out.size() * 2);
+  }
+  out.resize(strm.total_out_lo32);
+  BZ2_bzDecompressEnd(&strm);
+  return bzerror == BZ_STREAM_END;
+}
 
+bool decompressBZ2Serial(const std::byte *in, size_t in_size, const std::function<bool(const char *, size_t)> &output) {
   bz_stream strm = {};
   int bzerror = BZ2_bzDecompressInit(&strm, 0, 0);
   assert(bzerror == BZ_OK);
 
   strm.next_in = (char *)in;
   strm.avail_in = in_size;
-  std::string out(in_size * 5, '\0');
+  std::string out(1024 * 1024, '\0');
+  bool ok = true;
   do {
-    strm.next_out = (char *)(&out[strm.total_out_lo32]);
-    strm.avail_out = out.size() - strm.total_out_lo32;
-
-    const char *prev_write_pos = strm.next_out;
+    strm.next_out = out.data();
+    strm.avail_out = out.size();
     bzerror = BZ2_bzDecompress(&strm);
-    if (bzerror == BZ_OK && prev_write_pos == strm.next_out) {
-      // content is corrupt
-      bzerror = BZ_STREAM_END;
-      std::cout << "decompressBZ2 error : content is corrupt" << std::endl;
+    const size_t produced = out.size() - strm.avail_out;
+    if (produced > 0 && !output(out.data(), produced)) {
+      ok = false;
       break;
     }
-
-    if (bzerror == BZ_OK && strm.avail_in > 0 && strm.avail_out == 0) {
-      out.resize(out.size() * 2);
+    if (bzerror == BZ_OK && produced == 0 && strm.avail_in == 0) {
+      std::cout << "decompressBZ2 error : content is truncated" << std::endl;
+      ok = false;
+      break;
+    }
+    if (bzerror == BZ_STREAM_END && strm.avail_in > 0) {
+      // concatenated streams
+      BZ2_bzDecompressEnd(&strm);
+      char *next_in = strm.next_in;
+      unsigned int avail_in = strm.avail_in;
+      strm = {};
+      bzerror = BZ2_bzDecompressInit(&strm, 0, 0);
+      strm.next_in = next_in;
+      strm.avail_in = avail_in;
     }
   } while (bzerror == BZ_OK);
 
   BZ2_bzDecompressEnd(&strm);
-  if (bzerror == BZ_STREAM_END) {
-    out.resize(strm.total_out_lo32);
-    return out;
+  return ok && bzerror == BZ_STREAM_END;
+}
+
+} // namespace
+
+bool decompressBZ2(const std::byte *in, size_t in_size, const std::function<bool(const char *, size_t)> &output, int threads) {
+  if (in_size < 4 || memcmp(in, "BZh", 3) != 0) return false;
+
+  if (threads == 1 || in_size < BZ2_PARALLEL_MIN_SIZE) {
+    return decompressBZ2Serial(in, in_size, output);
+  }
+  BZ2Threads budget(threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency()));
+  if (budget.count == 0) {
+    return decompressBZ2Serial(in, in_size, output);
+  }
+  threads = budget.count;
+
+  const uint8_t *data = (const uint8_t *)in;
+  const uint64_t total_bits = in_size * 8;
+  std::vector<BZ2Marker> markers = findBZ2Markers(data, in_size, threads);
+  std::vector<size_t> blocks;  // indexes into markers
+  for (size_t i = 0; i < markers.size(); ++i) {
+    if (!markers[i].eos) blocks.push_back(i);
+  }
+  if (blocks.size() < 2) {
+    return decompressBZ2Serial(in, in_size, output);
+  }
+  auto blockEnd = [&](size_t marker_idx) {
+    return marker_idx + 1 < markers.size() ? markers[marker_idx + 1].bit : total_bits;
+  };
+
+  struct Result {
+    bool done = false, ok = false;
+    std::string out;
+  };
+  std::vector<Result> results(blocks.size());
+  std::mutex lock;
+  std::condition_variable cv;
+  size_t next_block = 0, consumed = 0;
+  bool stop = false;
+  const size_t max_ahead = threads * 2;
+
+  auto worker = [&]() {
+    while (true) {
+      size_t i;
+      {
+        std::unique_lock lk(lock);
+        cv.wait(lk, [&] { return stop || next_block < std::min(results.size(), consumed + max_ahead); });
+        if (stop || next_block >= results.size()) return;
+        i = next_block++;
+      }
+      std::string out;
+      bool ok = decompressBZ2Block(data, markers[blocks[i]].bit, blockEnd(blocks[i]), out);
+      {
+        std::unique_lock lk(lock);
+        results[i].out = std::move(out);
+        results[i].ok = ok;
+        results[i].done = true;
+      }
+      cv.notify_all();
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; ++t) workers.emplace_back(worker);
+
+  // hand blocks over in order
+  bool ok = true;
+  for (size_t i = 0; i < results.size() && ok;) {
+    std::string out;
+    bool block_ok;
+    {
+      std::unique_lock lk(lock);
+      cv.wait(lk, [&] { return results[i].done; });
+      out = std::move(results[i].out);
+      block_ok = results[i].ok;
+    }
+
+    size_t next = i + 1;
+    // a block magic can show up by chance inside compressed data, splitting a real block in two.
+    // retry with the following blocks merged in before giving up.
+    for (size_t merge = 1; !block_ok && merge <= 2 && i + merge < blocks.size(); ++merge) {
+      block_ok = decompressBZ2Block(data, markers[blocks[i]].bit, blockEnd(blocks[i + merge]), out);
+      next = i + merge + 1;
+    }
+
+    ok = block_ok && output(out.data(), out.size());
+    if (!block_ok) {
+      std::cout << "decompressBZ2 error : content is corrupt" << std::endl;
+    }
+    {
+      std::unique_lock lk(lock);
+      for (; i < next; ++i) results[i].out = std::string();
+      consumed = next;
+    }
+    cv.notify_all();
+  }
+
+  {
+    std::unique_lock lk(lock);
+    stop = true;
   }
-  return {};
+  cv.notify_all();
+  for (auto &w : workers) w.join();
+  return ok;
+}
+
+std::string decompressBZ2(const std::string &in) {
+  return decompressBZ2((std::byte *)in.data(), in.size());
+}
+
+std::string decompressBZ2(const std::byte *in, size_t in_size) {
+  std::string out;
+  bool ok = decompressBZ2(in, in_size, [&](const char *data, size_t size) {
+    out.append(data, size);
+    return true;
+  });
+  // keep what was decoded from a truncated or corrupt file, like a sequential reader would
+  return ok || !out.empty() ? out : std::string();
 }
 
 void precise_nano_sleep(long sleep_ns) {
@@ -251,11 +572,47 @@ void precise_nano_sleep(long sleep_ns) {
   }
 }
 
+bool writeNpy(const std::string &path, const char *dtype, size_t count, const std::string &data) {
+  // version 1.0 header, padded so the data starts 64 byte aligned
+  std::string header = util::string_format("{'descr': '%s', 'fortran_order': False, 'shape': (%zu,), }", dtype, count);
+  header.append(63 - (10 + header.size()) % 64, ' ');
+  header += '\n';
+  const uint16_t header_len = header.size();
+
+  std::ofstream fs(path, std::ios::binary | std::ios::trunc);
+  fs.write("\x93NUMPY\x01\x00", 8);
+  fs.write((const char *)&header_len, sizeof(header_len));
+  fs.write(header.data(), header.size());
+  fs.write(data.data(), data.size());
+  return fs.good();
+}
+
+void parallelFor(int count, int threads, const std::function<void(int)> &fn) {
+  if (count <= 0) return;
+
+  std::atomic<int> next = 0;
+  std::vector<std::thread> workers;
+  for (int i = 0; i < std::clamp(threads, 1, count); ++i) {
+    workers.emplace_back([&]() {
+      for (int n = next++; n < count; n = next++) {
+        fn(n);
+      }
+    });
+  }
+  for (auto &t : workers) {
+    t.join();
+  }
+}
+
 std::string sha256(const std::string &str) {
+  return sha256(str.data(), str.size());
+}
+
+std::string sha256(const void *data, size_t size) {
   unsigned char hash[SHA256_DIGEST_LENGTH];
   SHA256_CTX sha256;
   SHA256_Init(&sha256);
-  SHA256_Update(&sha256, str.c_str(), str.size());
+  SHA256_Update(&sha256, data, size);
   SHA256_Final(hash, &sha256);
   return util::hexdump(hash, SHA256_DIGEST_LENGTH);
 }
@@ -1,14 +1,25 @@
 #pragma once
 
 #include <atomic>
+#include <functional>
 #include <string>
 
 std::string sha256(const std::string &str);
+std::string sha256(const void *data, size_t size);
 void precise_nano_sleep(long sleep_ns);
 std::string decompressBZ2(const std::string &in);
 std::string decompressBZ2(const std::byte *in, size_t in_size);
+// decompress bz2 blocks in parallel, output is handed over in order. returning false from output stops decompression.
+// threads is an upper bound, concurrent calls share hardware_concurrency threads and fall back to serial.
+bool decompressBZ2(const std::byte *in, size_t in_size, const std::function<bool(const char *data, size_t size)> &output, int threads = 0);
 void enableHttpLogging(bool enable);
 std::string getUrlWithoutQuery(const std::string &url);
 size_t getRemoteFileSize(const std::string &url);
 std::string httpGet(const std::string &url, size_t chunk_size = 0, std::atomic<bool> *abort = nullptr);
+// resumes an earlier, interrupted download of file from the offset recorded in <file>.offset.
+// on failure file is cut back to the bytes that were completely downloaded.
 bool httpDownload(const std::string &url, const std::string &file, size_t chunk_size = 0, std::atomic<bool> *abort = nullptr);
+// write a 1-d numpy array, dtype is a numpy type string, e.g. "<f8"
+bool writeNpy(const std::string &path, const char *dtype, size_t count, const std::string &data);
+// calls fn(0) ... fn(count - 1) from up to `threads` threads
+void parallelFor(int count, int threads, const std::function<void(int)> &fn);
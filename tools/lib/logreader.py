@@ -9,10 +9,26 @@ from cereal import log as capnp_log
 from tools.lib.filereader import FileReader
 from tools.lib.route import Route, SegmentName
 
+try:
+  from selfdrive.ui.replay.logreader_pyx import LogReader as NativeLogReader, can_log_path, decode_can_log  # pylint: disable=no-name-in-module, import-error
+except ImportError:
+  NativeLogReader = None
+
+def _default_can_log_path(fn):
+  # only a local rlog can be checked for a rcan.bz2 next to it, remote ones come from Route.can_log_paths()
+  if urllib.parse.urlparse(fn).scheme in ("http", "https"):
+    return None
+  if NativeLogReader is not None:
+    return can_log_path(fn)
+  if os.path.basename(fn) == "rlog.bz2" and os.path.isfile(os.path.join(os.path.dirname(fn), "rcan.bz2")):
+    raise Exception(f"can/sendcan of {fn} are in rcan.bz2, which needs the native logreader")
+  return None
+
 # this is an iterator itself, and uses private variables from LogReader
 class MultiLogIterator:
-  def __init__(self, log_paths, sort_by_time=False):
+  def __init__(self, log_paths, sort_by_time=False, can_log_paths=None):
     self._log_paths = log_paths
+    self._can_log_paths = can_log_paths
     self.sort_by_time = sort_by_time
 
     self._first_log_idx = next(i for i in range(len(log_paths)) if log_paths[i] is not None)
@@ -24,7 +40,8 @@ class MultiLogIterator:
   def _log_reader(self, i):
     if self._log_readers[i] is None and self._log_paths[i] is not None:
       log_path = self._log_paths[i]
-      self._log_readers[i] = LogReader(log_path, sort_by_time=self.sort_by_time)
+      can_log_path = self._can_log_paths[i] if self._can_log_paths is not None else None
+      self._log_readers[i] = LogReader(log_path, sort_by_time=self.sort_by_time, can_fn=can_log_path)
 
     return self._log_readers[i]
 
@@ -68,31 +85,88 @@ class MultiLogIterator:
     return True
 
   def reset(self):
-    self.__init__(self._log_paths, sort_by_time=self.sort_by_time)
+    self.__init__(self._log_paths, sort_by_time=self.sort_by_time, can_log_paths=self._can_log_paths)
 
 class LogReader:
-  def __init__(self, fn, canonicalize=True, only_union_types=False, sort_by_time=False):
+  # can_fn is the rcan.bz2 loggerd wrote next to the rlog with LOGGERD_CAN_CODEC, its can/sendcan
+  # events are merged in. it's looked up next to local rlogs when not given.
+  def __init__(self, fn, canonicalize=True, only_union_types=False, sort_by_time=False, services=None, can_fn=None):
     data_version = None
     _, ext = os.path.splitext(urllib.parse.urlparse(fn).path)
-    with FileReader(fn) as f:
-      dat = f.read()
-
-    if ext == "":
-      # old rlogs weren't bz2 compressed
-      ents = capnp_log.Event.read_multiple_bytes(dat)
-    elif ext == ".bz2":
-      dat = bz2.decompress(dat)
-      ents = capnp_log.Event.read_multiple_bytes(dat)
+    if can_fn is None and ext == ".bz2":
+      can_fn = _default_can_log_path(fn)
+    self._native = None
+    self._ent_list = None
+    self._ts_list = None
+    self._which = None if services is None else {capnp_log.Event.schema.fields[s].proto.discriminantValue for s in services}
+
+    if ext == ".bz2" and NativeLogReader is not None and os.getenv("LOGREADER_BACKEND") != "python":
+      # decompressed and parsed in C++ with the GIL released. events come out sorted by time
+      # and are only wrapped for pycapnp while iterating, without copying them.
+      self._native = NativeLogReader()
+      if urllib.parse.urlparse(fn).scheme in ("http", "https"):
+        with FileReader(fn) as f:
+          ok = self._native.load_bytes(f.read())
+      else:
+        ok = self._native.load(fn)
+      if not ok:
+        raise Exception(f"failed to read log {fn}")
+
+      if can_fn is not None:
+        if urllib.parse.urlparse(can_fn).scheme in ("http", "https"):
+          with FileReader(can_fn) as f:
+            ok = self._native.load_can_log_bytes(f.read())
+        else:
+          ok = self._native.load_can_log(can_fn)
+        if not ok:
+          raise Exception(f"failed to read can log {can_fn}")
     else:
-      raise Exception(f"unknown extension {ext}")
+      with FileReader(fn) as f:
+        dat = f.read()
+
+      if ext == "":
+        # old rlogs weren't bz2 compressed
+        ents = capnp_log.Event.read_multiple_bytes(dat)
+      elif ext == ".bz2":
+        dat = bz2.decompress(dat)
+        ents = capnp_log.Event.read_multiple_bytes(dat)
+      else:
+        raise Exception(f"unknown extension {ext}")
+
+      if can_fn is not None:
+        if NativeLogReader is None:
+          raise Exception(f"reading can log {can_fn} needs the native logreader")
+        with FileReader(can_fn) as f:
+          can_ents = capnp_log.Event.read_multiple_bytes(decode_can_log(bz2.decompress(f.read())))
+        # can/sendcan are interleaved with the rest of the log by time
+        ents = sorted(list(ents) + list(can_ents), key=lambda x: x.logMonoTime)
+
+      if self._which is not None:
+        ents = (e for e in ents if e.which() in services)
+      self._ent_list = list(sorted(ents, key=lambda x: x.logMonoTime) if sort_by_time else ents)
 
-    self._ents = list(sorted(ents, key=lambda x: x.logMonoTime) if sort_by_time else ents)
-    self._ts = [x.logMonoTime for x in self._ents]
     self.data_version = data_version
     self._only_union_types = only_union_types
 
+  def _native_events(self):
+    for _, _, dat in self._native.events(self._which):
+      yield capnp_log.Event.from_bytes(dat, traversal_limit_in_words=2**64-1)
+
+  @property
+  def _ents(self):
+    if self._ent_list is None:
+      self._ent_list = list(self._native_events())
+    return self._ent_list
+
+  @property
+  def _ts(self):
+    if self._ts_list is None:
+      self._ts_list = [x.logMonoTime for x in self._ents]
+    return self._ts_list
+
   def __iter__(self):
-    for ent in self._ents:
+    ents = self._ents if self._ent_list is not None else self._native_events()
+    for ent in ents:
       if self._only_union_types:
         try:
           ent.which()
@@ -107,9 +181,9 @@ def logreader_from_route_or_segment(r):
   sn = SegmentName(r, allow_route_name=True)
   route = Route(sn.route_name.canonical_name)
   if sn.segment_num < 0:
-    return MultiLogIterator(route.log_paths())
+    return MultiLogIterator(route.log_paths(), can_log_paths=route.can_log_paths())
   else:
-    return LogReader(route.log_paths()[sn.segment_num])
+    return LogReader(route.log_paths()[sn.segment_num], can_fn=route.can_log_paths()[sn.segment_num])
 
 
 if __name__ == "__main__":
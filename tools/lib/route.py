@@ -11,6 +11,7 @@ from tools.lib.helpers import RE
 QLOG_FILENAMES = ['qlog.bz2']
 QCAMERA_FILENAMES = ['qcamera.ts']
 LOG_FILENAMES = ['rlog.bz2', 'raw_log.bz2']
+CAN_LOG_FILENAMES = ['rcan.bz2']
 CAMERA_FILENAMES = ['fcamera.hevc', 'video.hevc']
 DCAMERA_FILENAMES = ['dcamera.hevc']
 ECAMERA_FILENAMES = ['ecamera.hevc']
@@ -37,6 +38,10 @@ class Route:
     log_path_by_seg_num = {s.name.segment_num: s.log_path for s in self._segments}
     return [log_path_by_seg_num.get(i, None) for i in range(self.max_seg_number+1)]
 
+  def can_log_paths(self):
+    can_log_path_by_seg_num = {s.name.segment_num: s.can_log_path for s in self._segments}
+    return [can_log_path_by_seg_num.get(i, None) for i in range(self.max_seg_number+1)]
+
   def qlog_paths(self):
     qlog_path_by_seg_num = {s.name.segment_num: s.qlog_path for s in self._segments}
     return [qlog_path_by_seg_num.get(i, None) for i in range(self.max_seg_number+1)]
@@ -76,6 +81,7 @@ class Route:
           url if fn in DCAMERA_FILENAMES else segments[segment_name].dcamera_path,
           url if fn in ECAMERA_FILENAMES else segments[segment_name].ecamera_path,
           url if fn in QCAMERA_FILENAMES else segments[segment_name].qcamera_path,
+          url if fn in CAN_LOG_FILENAMES else segments[segment_name].can_log_path,
         )
       else:
         segments[segment_name] = Segment(
@@ -86,6 +92,7 @@ class Route:
           url if fn in DCAMERA_FILENAMES else None,
           url if fn in ECAMERA_FILENAMES else None,
           url if fn in QCAMERA_FILENAMES else None,
+          url if fn in CAN_LOG_FILENAMES else None,
         )
 
     return sorted(segments.values(), key=lambda seg: seg.name.segment_num)
@@ -151,14 +158,19 @@ class Route:
       except StopIteration:
         qcamera_path = None
 
-      segments.append(Segment(segment, log_path, qlog_path, camera_path, dcamera_path, ecamera_path, qcamera_path))
+      try:
+        can_log_path = next(path for path, filename in files if filename in CAN_LOG_FILENAMES)
+      except StopIteration:
+        can_log_path = None
+
+      segments.append(Segment(segment, log_path, qlog_path, camera_path, dcamera_path, ecamera_path, qcamera_path, can_log_path))
 
     if len(segments) == 0:
       raise ValueError(f'Could not find segments for route {self.name.canonical_name} in data directory {data_dir}')
     return sorted(segments, key=lambda seg: seg.name.segment_num)
 
 class Segment:
-  def __init__(self, name, log_path, qlog_path, camera_path, dcamera_path, ecamera_path, qcamera_path):
+  def __init__(self, name, log_path, qlog_path, camera_path, dcamera_path, ecamera_path, qcamera_path, can_log_path=None):
     self._name = SegmentName(name)
     self.log_path = log_path
     self.qlog_path = qlog_path
@@ -166,6 +178,8 @@ class Segment:
     self.dcamera_path = dcamera_path
     self.ecamera_path = ecamera_path
     self.qcamera_path = qcamera_path
+    # can/sendcan of the rlog when loggerd wrote them in columnar form
+    self.can_log_path = can_log_path
 
   @property
   def name(self):